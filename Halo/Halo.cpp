@@ -18,11 +18,7 @@ mutex PM_MemoryManager::mtx;
 mutex DRAM_MemoryManager::mtx;
 mutex MemoryManagerPool::mtx_pm_pool;
 thread_local PM_MemoryManager mmanager;
-thread_local int *INSERT_RESULT_POINTER[MAX_BUFFER_PAIR_SIZE];
-thread_local size_t WRITE_BUFFER_COUNTER(0);
 thread_local char WRITE_BUFFER[MAX_WRITE_BUFFER_SIZE];
-thread_local size_t WRITE_BUFFER_SIZE(0);
-thread_local size_t WRITE_PASS_COUNT(0);
 thread_local void *BUFFER_READ[READ_BUFFER_SIZE];
 thread_local size_t BUFFER_READ_COUNTER(0);
 
@@ -34,17 +30,29 @@ std::atomic<uint64_t> halo_count1{0};
 std::atomic<uint64_t> halo_count2{0};
 std::atomic<uint64_t> halo_count3{0};
 std::atomic<uint64_t> halo_write_count{0};
+std::atomic<uint64_t> xpline_bytes{0};
+std::atomic<uint64_t> xpline_count{0};
+
+GroupCommit group_commit;
 
 // ===========For reclaim=================
-std::mutex RECLAIM_MTX;
-atomic_bool RECLAIM(false);
-bool RECLAIM_LOCK[CORE_NUM];
-std::vector<thread> reclaim_threads;
-std::mutex thread_mutex;
+EpochManager epoch_manager;
+struct EpochSlot {
+  int id = -1;
+  size_t depth = 0;
+  ~EpochSlot() {
+    if (id != -1) epoch_manager.unregister_thread(id);
+  }
+};
+thread_local EpochSlot epoch_slot;
 
 root *ROOT;
 atomic_size_t PPage_table[MAX_PAGE_NUM];
+FreeSpace free_space;
 char *DPage_table[MAX_PAGE_NUM];
+// DPages not loaded from the snapshot yet after a lazy restart
+LazyRegion *DPage_lazy[MAX_PAGE_NUM];
+atomic_bool LAZY_LOADING(false);
 enum PM_FILE_NAME {
   SEGMENT_SNAPSHOT = 's',
   DPAGE_SNAPSHOT = 'd',
@@ -63,33 +71,176 @@ std::string generate_filename(PM_FILE_NAME type, size_t snapshot_version,
 std::vector<size_t> nphase() {
   std::vector<size_t> checkpoint(CORE_NUM);
   for (size_t i = 0; i < CORE_NUM; i++) {
-    checkpoint[i] = ROOT->CURRENT_PPAGE_ID[i];
+    // all PPages of an allocator without one yet are written after
+    checkpoint[i] =
+        ROOT->CURRENT_PPAGE_ID[i] == INVALID ? 0 : ROOT->CURRENT_PPAGE_ID[i];
   }
   return checkpoint;
 }
-char *get_DPage_addr(size_t offset) {
-  if (offset != INVALID) {
-    auto addr = DPage_table[offset / PAGE_SIZE];
-    if (Unlikely(addr == nullptr)) assert(addr == nullptr);
-    return addr + offset % PAGE_SIZE;
+// DPages are aligned to their size, a bucket finds the header of its DPage.
+static PAGE_METADATA *DPage_header(size_t addr) {
+  return reinterpret_cast<PAGE_METADATA *>(addr & ~(PAGE_SIZE - 1));
+}
+size_t get_DPage_offset(size_t next) {
+  if (next == INVALID) return INVALID;
+  return DPage_header(next)->PAGEID * PAGE_SIZE + next % PAGE_SIZE;
+}
+void touch_DPage(const volatile void *addr) {
+  auto a = reinterpret_cast<size_t>(addr);
+  lazy_touch(DPage_lazy[DPage_header(a)->PAGEID], addr);
+}
+/* The DRAM address of a DPage offset read from a snapshot. */
+static size_t swizzle(size_t offset) {
+  if (offset == INVALID || offset / PAGE_SIZE >= MAX_PAGE_NUM) return INVALID;
+  auto page = DPage_table[offset / PAGE_SIZE];
+  // unused bucket space of a snapshot may hold anything
+  if (page == nullptr) return INVALID;
+  return reinterpret_cast<size_t>(page + offset % PAGE_SIZE);
+}
+/**
+ * @brief Link the chains of the restored sub-tables by DRAM addresses.
+ *
+ * @param repair after a crash. A checkpoint may copy a reused bucket in its
+ * old and its new chain, so entries of other bins are dropped and a bucket is
+ * cut from the second chain reaching it. Its entries were added after the
+ * checkpoint began and are put back by the redo log. The used size of the
+ * DPages is taken from the buckets reached, their headers were copied to the
+ * snapshot before the DPages filled up.
+ */
+static void swizzle_chains(CLHT *clhts[TABLE_NUM], bool repair) {
+  parallel_for(TABLE_NUM, [clhts, repair](size_t i) {
+    auto seg = clhts[i]->table;
+    std::unordered_set<size_t> reached;
+    if (repair)
+      for (auto &&p : seg->hallocD->pages)
+        reinterpret_cast<PAGE_METADATA *>(DPage_table[p])->LOCAL_OFFSET =
+            PRESERVE_SIZE_EACH_PAGE;
+    for (size_t j = 0; j < seg->num_buckets; j++)
+      for (auto b = seg->buckets + j;;) {
+        if (repair) {
+          for (int k = 0; k < ENTRIES_PER_BUCKET; k++) {
+            if (!b->used(k)) continue;
+            auto hkey = b->hkey(k, clhts[i]->record_hkey);
+            if (hkey != INVALID && (hkey & seg->hash) != j) b->clear(k);
+          }
+          size_t next = b->next;
+          if (next != INVALID && !reached.insert(next).second)
+            b->next = INVALID;
+        }
+        if (b->next == INVALID) break;
+        b->next = swizzle(b->next);
+        b = reinterpret_cast<Bucket *>(b->next);
+        if (repair) {
+          auto addr = reinterpret_cast<size_t>(b);
+          auto header = DPage_header(addr);
+          if (header->ALLOCATOR_ID == i)
+            header->LOCAL_OFFSET = std::max<size_t>(
+                header->LOCAL_OFFSET, addr % PAGE_SIZE + sizeof(Bucket));
+        }
+      }
+  });
+}
+/* Link the chains by DPage offsets again before they are written out. */
+static void unswizzle_chains(CLHT *clhts[TABLE_NUM]) {
+  parallel_for(TABLE_NUM, [clhts](size_t i) {
+    auto seg = clhts[i]->table;
+    for (size_t j = 0; j < seg->num_buckets; j++)
+      for (auto b = seg->buckets + j; b->next != INVALID;) {
+        auto next = reinterpret_cast<Bucket *>(b->next);
+        b->next = get_DPage_offset(b->next);
+        b = next;
+      }
+  });
+}
+
+int EpochManager::register_thread() {
+  for (size_t i = 0; i < CORE_NUM; i++) {
+    bool used = false;
+    if (slots[i].used.compare_exchange_strong(used, true)) return i;
+  }
+  cerr << "THREAD_NUM exceeded\n======================================="
+       << endl;
+  std::exit(0);
+}
+void EpochManager::unregister_thread(int id) {
+  slots[id].epoch.store(EPOCH_INACTIVE);
+  slots[id].used.store(false);
+}
+void EpochManager::enter() {
+  auto &s = epoch_slot;
+  if (s.depth++) return;
+  if (Unlikely(s.id == -1)) s.id = register_thread();
+  // seq_cst: the announcement is visible before any index access.
+  slots[s.id].epoch.store(global_epoch.load(memory_order_relaxed));
+}
+void EpochManager::exit() {
+  auto &s = epoch_slot;
+  if (--s.depth) return;
+  slots[s.id].epoch.store(EPOCH_INACTIVE, memory_order_release);
+}
+void EpochManager::retire(std::function<void()> f) {
+  {
+    lock_guard<mutex> guard(mtx);
+    retired.push({global_epoch.fetch_add(1), std::move(f)});
+    unfreed++;
+    if (!running) {
+      running = true;
+      collector = thread(&EpochManager::collect, this);
+    }
   }
-  return nullptr;
+  cv.notify_one();
 }
-void READ_LOCK() {
-  if (RECLAIM.load()) RECLAIM_LOCK[mmanager.ID] = true;
+size_t EpochManager::min_epoch() {
+  size_t min = EPOCH_INACTIVE;
+  for (size_t i = 0; i < CORE_NUM; i++)
+    min = std::min<size_t>(min, slots[i].epoch.load());
+  return min;
 }
-void WAIT_READ_LOCK() {
+void EpochManager::collect() {
+  unique_lock<mutex> lock(mtx);
   while (true) {
-    int count = 0;
-    if (mmanager.ID != -1 && mmanager.workthread)
-      RECLAIM_LOCK[mmanager.ID] = true;
-    for (size_t i = 0; i < CORE_NUM; i++)
-      if (RECLAIM_LOCK[i]) count++;
-    if (count == memory_manager_Pool.thread_counter.load()) break;
+    cv.wait(lock, [this] { return !running || !retired.empty(); });
+    if (retired.empty()) return;
+    // threads that entered after the retirement cannot see the memory.
+    auto min = min_epoch();
+    std::vector<std::function<void()>> safe;
+    while (!retired.empty() && retired.front().first < min) {
+      safe.push_back(std::move(retired.front().second));
+      retired.pop();
+    }
+    if (safe.empty()) {
+      cv.wait_for(lock, std::chrono::milliseconds(1));
+      continue;
+    }
+    lock.unlock();
+    for (auto &&f : safe) f();
+    lock.lock();
+    unfreed -= safe.size();
+    cv_drain.notify_all();
+  }
+}
+void EpochManager::drain() {
+  unique_lock<mutex> lock(mtx);
+  cv_drain.wait(lock, [this] { return !unfreed; });
+}
+void EpochManager::stop() {
+  {
+    lock_guard<mutex> guard(mtx);
+    running = false;
   }
+  cv.notify_all();
+  if (collector.joinable()) collector.join();
 }
-void RELEASE_READ_LOCK() {
-  for (size_t i = 0; i < CORE_NUM; i++) RECLAIM_LOCK[i] = false;
+void parallel_for(size_t n, const std::function<void(size_t)> &f) {
+  size_t workers = std::max(1U, thread::hardware_concurrency());
+  workers = std::min(workers, n);
+  atomic_size_t next(0);
+  vector<thread> t;
+  for (size_t i = 0; i < workers; i++)
+    t.push_back(thread([&]() {
+      for (size_t j = next++; j < n; j = next++) f(j);
+    }));
+  for (auto &&i : t) i.join();
 }
 std::vector<std::string> split(const std::string &str,
                                const std::string &delims = " ") {
@@ -104,10 +255,265 @@ std::vector<std::string> split(const std::string &str,
   }
   return output;
 }
-void MemoryManager::delete_pm_file(size_t page_id) {
-  auto addr = reinterpret_cast<void *>(PPage_table[page_id].load());
+void LazyRegion::fault(size_t chunk) {
+  uint8_t s = CHUNK_UNLOADED;
+  if (state[chunk].compare_exchange_strong(s, CHUNK_LOADING)) {
+    auto off = chunk * LAZY_CHUNK_SIZE;
+    auto len = std::min(LAZY_CHUNK_SIZE, size - off);
+    memcpy(dst + off, src + off, len);
+    for (auto b = reinterpret_cast<Bucket *>(dst + off);
+         b < reinterpret_cast<Bucket *>(dst + off + len); b++)
+      b->next = swizzle(b->next);
+    state[chunk].store(CHUNK_LOADED, memory_order_release);
+  } else {
+    while (state[chunk].load(memory_order_acquire) != CHUNK_LOADED)
+      _mm_pause();
+  }
+}
+void MemoryManager::delete_pm_file(size_t page_id, void *addr) {
   pmem_unmap(addr, PAGE_SIZE);
-  filesystem::remove(PM_PATH + to_string(page_id));
+  filesystem::remove(PM_PATH + "P_" + to_string(page_id));
+}
+
+void RateLimiter::set_rate(size_t bytes_per_sec) {
+  lock_guard<mutex> guard(mtx);
+  rate = bytes_per_sec;
+  tokens = rate;
+  last = std::chrono::steady_clock::now();
+}
+void RateLimiter::acquire(size_t bytes) {
+  if (!rate) return;
+  double wait;
+  {
+    lock_guard<mutex> guard(mtx);
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> e = now - last;
+    last = now;
+    // allow a burst of at most one second
+    tokens = std::min<double>(rate, tokens + e.count() * rate) - bytes;
+    wait = tokens < 0 ? -tokens / rate : 0;
+  }
+  if (wait > 0) std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+}
+
+void LogCleaner::start(const LogCleanerOptions &opt, Relocate f) {
+  lock_guard<mutex> guard(mtx);
+  if (running) return;
+  options = opt;
+  relocate = f;
+  limiter.set_rate(options.rate_limit);
+  running = true;
+  for (size_t i = 0; i < options.workers; i++)
+    workers.push_back(thread(&LogCleaner::work, this));
+}
+void LogCleaner::stop() {
+  {
+    lock_guard<mutex> guard(mtx);
+    running = false;
+  }
+  cv.notify_all();
+  for (auto &&t : workers) t.join();
+  workers.clear();
+}
+void LogCleaner::submit(size_t page_id, size_t freed) {
+  {
+    lock_guard<mutex> guard(mtx);
+    if (!running || pending.count(page_id)) return;
+    pending.insert(page_id);
+    victims.push({freed, page_id});
+  }
+  cv.notify_one();
+}
+void LogCleaner::work() {
+  PM_MemoryManager cold, hot;
+  memory_manager_Pool.get_PM_MemoryManager(&cold, false);
+  memory_manager_Pool.get_PM_MemoryManager(&hot, false);
+  while (true) {
+    size_t page_id;
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait(lock, [this] { return !running || !victims.empty(); });
+      if (!running) return;
+      page_id = victims.top().second;
+      victims.pop();
+    }
+    relocate(page_id, cold, hot);
+    pages_freed++;
+  }
+}
+
+size_t GroupCommit::commit(const char *record, size_t len) {
+  auto &r = requests[mmanager.ID];
+  r.len = len;
+  r.done.store(false, std::memory_order_relaxed);
+  r.record.store(record, std::memory_order_release);
+  for (size_t spin = 0; !r.done.load(std::memory_order_acquire); spin++) {
+    if (combiner.try_lock()) {
+      if (!r.done.load(std::memory_order_acquire)) combine();
+      combiner.unlock();
+    } else if (spin < 64) {
+      _mm_pause();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  return r.offset;
+}
+
+void GroupCommit::combine() {
+  Request *batch[CORE_NUM];
+  size_t n = 0, total = 0;
+  for (size_t i = 0; i < CORE_NUM; i++) {
+    auto &r = requests[i];
+    if (!r.record.load(std::memory_order_acquire)) continue;
+    if (total + r.len > GROUP_COMMIT_MAX_SIZE && n) break;
+    batch[n++] = &r;
+    total += r.len;
+  }
+  if (XPLINE_LOG) {
+    // stage the batch to write it as whole XPLines
+    static thread_local char staging[GROUP_COMMIT_MAX_SIZE];
+    size_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+      memcpy(staging + off, batch[i]->record.load(std::memory_order_relaxed),
+             batch[i]->len);
+      off += batch[i]->len;
+    }
+    auto o_a = mmanager.append_xpline(staging, total);
+    off = 0;
+    for (size_t i = 0; i < n; i++) {
+      batch[i]->offset = o_a.first + off;
+      off += batch[i]->len;
+    }
+  } else {
+    auto o_a = mmanager.halloc(total);
+    size_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+      auto r = batch[i];
+      pmem_memcpy(o_a.second + off, r->record.load(std::memory_order_relaxed),
+                  r->len, PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+      r->offset = o_a.first + off;
+      off += r->len;
+    }
+  }
+  pmem_drain();
+  mmanager.update_metadata();
+  batches++;
+  records += n;
+  for (size_t i = 0; i < n; i++) {
+    batch[i]->record.store(nullptr, std::memory_order_relaxed);
+    batch[i]->done.store(true, std::memory_order_release);
+  }
+}
+
+// guards the registration of write batches
+static mutex batch_mtx;
+struct BatchHolder {
+  WriteBatch *batch = nullptr;
+  ~BatchHolder() {
+    if (!batch) return;
+    lock_guard<mutex> guard(batch_mtx);
+    // the flusher writes what is left and frees it
+    if (batch->flusher)
+      batch->orphaned = true;
+    else
+      delete batch;
+  }
+};
+static thread_local BatchHolder batch_holder;
+
+void BatchFlusher::start(size_t bound_us, std::function<void(WriteBatch &)> f) {
+  lock_guard<mutex> guard(mtx);
+  if (running) return;
+  bound = bound_us;
+  flush = f;
+  running = true;
+  worker = thread(&BatchFlusher::work, this);
+}
+void BatchFlusher::stop() {
+  {
+    lock_guard<mutex> guard(mtx);
+    if (!running) return;
+    running = false;
+  }
+  cv.notify_all();
+  if (worker.joinable()) worker.join();
+  flush_batches(true);
+}
+WriteBatch &BatchFlusher::local() {
+  auto b = batch_holder.batch;
+  if (Likely(b && b->flusher == this)) return *b;
+  lock_guard<mutex> guard(batch_mtx);
+  if (!b) b = batch_holder.batch = new WriteBatch;
+  b->flusher = this;
+  batches.push_back(b);
+  return *b;
+}
+void BatchFlusher::flush_batches(bool all) {
+  lock_guard<mutex> guard(batch_mtx);
+  for (auto &&b : batches) {
+    if (all || b->orphaned) {
+      b->mtx.lock();
+    } else if (!expired(*b) || !b->mtx.try_lock()) {
+      continue;
+    }
+    if (b->count) {
+      flush(*b);
+      if (!all) timed_flushes++;
+    }
+    b->mtx.unlock();
+  }
+  auto it = std::remove_if(batches.begin(), batches.end(), [all](WriteBatch *b) {
+    if (b->orphaned) {
+      delete b;
+      return true;
+    }
+    if (all) b->flusher = nullptr;
+    return all;
+  });
+  batches.erase(it, batches.end());
+}
+void BatchFlusher::work() {
+  while (true) {
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait_for(lock, std::chrono::microseconds(bound / 2 + 1),
+                  [this] { return !running; });
+      if (!running) return;
+    }
+    flush_batches(false);
+  }
+}
+
+void Checkpointer::start(size_t interval_sec, size_t rate_limit,
+                         std::function<void()> f) {
+  lock_guard<mutex> guard(mtx);
+  if (running) return;
+  interval = interval_sec;
+  checkpoint = f;
+  limiter.set_rate(rate_limit);
+  running = true;
+  worker = thread(&Checkpointer::work, this);
+}
+void Checkpointer::stop() {
+  {
+    lock_guard<mutex> guard(mtx);
+    running = false;
+  }
+  cv.notify_all();
+  if (worker.joinable()) worker.join();
+}
+void Checkpointer::work() {
+  while (true) {
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait_for(lock, std::chrono::seconds(interval),
+                  [this] { return !running; });
+      if (!running) return;
+    }
+    checkpoint();
+    checkpoints++;
+  }
 }
 
 pair<size_t, char *> DRAM_MemoryManager::halloc(size_t size) {
@@ -116,6 +522,7 @@ pair<size_t, char *> DRAM_MemoryManager::halloc(size_t size) {
   while (true) {
     if (local_offset + size < PAGE_SIZE) {
       local_offset += size;
+      lazy_touch(DPage_lazy[current_PAGE_ID], base_addr + local_offset - size);
       return {local_offset + current_PAGE_ID * PAGE_SIZE - size,
               base_addr + local_offset - size};
     } else {
@@ -123,76 +530,146 @@ pair<size_t, char *> DRAM_MemoryManager::halloc(size_t size) {
     }
   }
 }
+char *DRAM_MemoryManager::alloc_bucket() {
+  // a popped bucket is not freed and pushed again while the guard is held
+  EpochGuard guard;
+  auto b = free_list.load(memory_order_acquire);
+  while (b && !free_list.compare_exchange_weak(
+                  b, reinterpret_cast<char *>(
+                         reinterpret_cast<Bucket *>(b)->next)))
+    ;
+  if (b) return b;
+  auto &slab = slabs[epoch_slot.id];
+  if (Unlikely(slab.next == slab.end)) {
+    auto r = halloc(BUCKET_SLAB_SIZE * sizeof(Bucket));
+    slab.next = r.second;
+    slab.end = r.second + BUCKET_SLAB_SIZE * sizeof(Bucket);
+    // halloc loaded the chunk of the first bucket only
+    lazy_touch(DPage_lazy[r.first / PAGE_SIZE], slab.end - 1);
+  }
+  b = slab.next;
+  slab.next += sizeof(Bucket);
+  return b;
+}
+void DRAM_MemoryManager::free_bucket(char *bucket) {
+  epoch_manager.retire([this, bucket]() {
+    auto head = free_list.load();
+    do {
+      reinterpret_cast<Bucket *>(bucket)->next = reinterpret_cast<size_t>(head);
+    } while (!free_list.compare_exchange_weak(head, bucket));
+  });
+}
+
+size_t DRAM_MemoryManager::allocated() {
+  lock_guard<mutex> guard(alloc_mtx);
+  if (pages.empty()) return 0;
+  return (pages.size() - 1) * PAGE_SIZE + local_offset;
+}
 
 void DRAM_MemoryManager::creat_new_space() {
   lock_guard<mutex> guard(DRAM_MemoryManager::mtx);
   if (base_addr)
     reinterpret_cast<PAGE_METADATA *>(base_addr)->LOCAL_OFFSET = local_offset;
-  base_addr = static_cast<char *>(aligned_alloc(CACHE_LINE_SIZE, PAGE_SIZE));
+  base_addr = static_cast<char *>(aligned_alloc(PAGE_SIZE, PAGE_SIZE));
   current_PAGE_ID = DRAM_MemoryManager::PAGE_ID++;
+  reinterpret_cast<PAGE_METADATA *>(base_addr)->PAGEID = current_PAGE_ID;
   DPage_table[current_PAGE_ID] = base_addr;
   pages.push_back(current_PAGE_ID);
   // std::cout << "Create DPage: " << current_PAGE_ID << std::endl;
   local_offset = PRESERVE_SIZE_EACH_PAGE;
   reinterpret_cast<PAGE_METADATA *>(base_addr)->ALLOCATOR_ID = ID;
 }
-void DRAM_MemoryManager::persist(Segment *ht_new,
-                                 std::vector<size_t> checkpoints) {
-  if (!SNAPSHOT) return;
-  snapshot_version++;
-  // thread t(
-  //     [](Segment *ht_new, std::vector<size_t> &checkpoints,
-  //        size_t snapshot_version, int ID, std::vector<size_t> &pages,
-  //        DRAM_MemoryManager *dm) {
-  // persist Segment
-  auto size = ht_new->num_buckets * sizeof(Bucket);
-  auto ptr = reinterpret_cast<char *>(ht_new->buckets);
-  auto addr = static_cast<char *>(map_pm_file(
-      size,
-      generate_filename(PM_FILE_NAME::SEGMENT_SNAPSHOT, snapshot_version, ID)));
-  for (size_t i = 0; i < size; i += 8) {
-    _mm_stream_si64(reinterpret_cast<long long *>(addr + i),
-                    *(reinterpret_cast<long long *>(ptr + i)));
+/* Remove the snapshot files of a sub-table except those of `keep_version`. */
+void remove_snapshot(size_t ID, size_t keep_version) {
+  for (auto &&entry : filesystem::directory_iterator(PM_PATH)) {
+    string name = entry.path().filename();
+    if (name[0] != PM_FILE_NAME::SEGMENT_SNAPSHOT &&
+        name[0] != PM_FILE_NAME::DPAGE_SNAPSHOT)
+      continue;
+    auto s = split(name, "_");
+    if (stoull(s[2]) == ID && stoull(s[1]) != keep_version)
+      filesystem::remove(entry.path());
   }
-  pmem_drain();
-  pmem_unmap(addr, size);
-
-  // persist DPages
-  for (auto &&p : pages) {
-    auto aid = reinterpret_cast<PAGE_METADATA *>(DPage_table[p])->ALLOCATOR_ID;
-    if (ID == aid) {
-      auto addr = static_cast<char *>(
-          map_pm_file(PAGE_SIZE, generate_filename(PM_FILE_NAME::DPAGE_SNAPSHOT,
-                                                   snapshot_version, ID, p)));
-      auto page_addr = DPage_table[p];
-      for (size_t i = 0; i < PAGE_SIZE; i += 8) {
-        _mm_stream_si64(reinterpret_cast<long long *>(addr + i),
-                        *(reinterpret_cast<long long *>(page_addr + i)));
-      }
-      pmem_drain();
-      pmem_unmap(addr, PAGE_SIZE);
-    } else
-      break;
+}
+/**
+ * @brief Checkpoint a segment. The first checkpoint of a segment writes a new
+ * snapshot version and keeps its files mapped, the following ones only write
+ * the chains of the dirty buckets into them. Buckets may change while they
+ * are copied, the redo log from `checkpoints` fixes them up after a crash.
+ *
+ * @param seg the segment allocated from this manager.
+ * @param checkpoints the current PPage of each allocator, taken before.
+ */
+void DRAM_MemoryManager::checkpoint(Segment *seg,
+                                    const std::vector<size_t> &checkpoints,
+                                    Checkpointer &ckpt) {
+  auto chunks = (seg->num_buckets + CHECKPOINT_CHUNK - 1) / CHECKPOINT_CHUNK;
+  bool full = snapshot_segment == nullptr;
+  std::vector<size_t> dirty;
+  for (size_t i = 0; i < chunks; i++) {
+    if (full || seg->dirty[i]) {
+      seg->dirty[i] = 0;
+      dirty.push_back(i);
+    }
+  }
+  // changes after the flags are cleared mark them again
+  _mm_mfence();
+
+  if (full) {
+    auto size = seg->num_buckets * sizeof(Bucket);
+    snapshot_version++;
+    snapshot_size = size;
+    snapshot_segment = static_cast<char *>(map_pm_file(
+        size,
+        generate_filename(PM_FILE_NAME::SEGMENT_SNAPSHOT, snapshot_version, ID)));
+  }
+  // the buckets are copied through a buffer to link them by DPage offsets
+  alignas(CACHE_LINE_SIZE) char buf[CHECKPOINT_CHUNK * sizeof(Bucket)];
+  auto copy = reinterpret_cast<Bucket *>(buf);
+  auto snapshot_bucket = [this, &ckpt, copy](Bucket *src) {
+    memcpy(copy, src, sizeof(Bucket));
+    copy->next = get_DPage_offset(copy->next);
+    auto offset = get_DPage_offset(reinterpret_cast<size_t>(src));
+    auto page_id = offset / PAGE_SIZE;
+    auto &dst = snapshot_pages[page_id];
+    if (dst == nullptr) {
+      dst = static_cast<char *>(map_pm_file(
+          PAGE_SIZE, generate_filename(PM_FILE_NAME::DPAGE_SNAPSHOT,
+                                       snapshot_version, ID, page_id)));
+      pmem_memcpy_nodrain(dst, DPage_table[page_id], PRESERVE_SIZE_EACH_PAGE);
+    }
+    pmem_memcpy_nodrain(dst + offset % PAGE_SIZE, copy, sizeof(Bucket));
+    ckpt.throttle(sizeof(Bucket));
+  };
+  for (auto &&c : dirty) {
+    auto first = c * CHECKPOINT_CHUNK;
+    auto n = std::min(CHECKPOINT_CHUNK, seg->num_buckets - first);
+    memcpy(buf, seg->buckets + first, n * sizeof(Bucket));
+    for (size_t i = 0; i < n; i++)
+      copy[i].next = get_DPage_offset(copy[i].next);
+    pmem_memcpy_nodrain(snapshot_segment + first * sizeof(Bucket), buf,
+                        n * sizeof(Bucket));
+    ckpt.throttle(n * sizeof(Bucket));
+    for (size_t i = first; i < first + n; i++)
+      for (auto b = seg->buckets[i].next_bucket(); b; b = b->next_bucket())
+        snapshot_bucket(b);
   }
+  pmem_drain();
 
   // update ROOT info
   {
-    // log-free consistency safe
     lock_guard<mutex> guard(ROOT->mtx);
-    // if crash here, we use old snapshot verison.
-    ROOT->SS[ID].SEGMENT_SIZE = ht_new->num_buckets;
-    ROOT->CURRENT_DPAGE_ID[ID] = current_PAGE_ID;
-    pmem_persist(&ROOT->CURRENT_DPAGE_ID[ID], sizeof(size_t));
+    if (full) {
+      // if crash here, we use old snapshot verison.
+      ROOT->SS[ID].SEGMENT_SIZE = seg->num_buckets;
+      ROOT->SS[ID].SNAPSHOT_VERSION = snapshot_version;
+      pmem_persist(&ROOT->SS[ID], sizeof(ROOT->SS[ID]));
+    }
     {
       lock_guard<mutex> guard(DRAM_MemoryManager::mtx);
       ROOT->DPAGE_ID = DRAM_MemoryManager::PAGE_ID;
     }
     pmem_persist(&ROOT->DPAGE_ID, sizeof(size_t));
-
-    // after updateing SNAPSHOT_VERSION, we can use the new snapshot
-    ROOT->SS[ID].SNAPSHOT_VERSION = snapshot_version;
-    pmem_persist(&ROOT->SS[ID], sizeof(ROOT->SS[ID]));
-
     // if crash here, we use new snapshot verison but redo more logs(from last
     // checkpoint).
     for (size_t i = 0; i < CORE_NUM; i++) {
@@ -200,40 +677,34 @@ void DRAM_MemoryManager::persist(Segment *ht_new,
     }
     pmem_persist(ROOT->SEGMENT_CHECKPOINT[ID], sizeof(size_t) * CORE_NUM);
   }
-
-  // free old DPage
-  filesystem::remove(generate_filename(PM_FILE_NAME::DPAGE_SNAPSHOT,
-                                       snapshot_version - 1, ID));
-
-  filesystem::remove(generate_filename(PM_FILE_NAME::SEGMENT_SNAPSHOT,
-                                       snapshot_version - 1, ID));
-  // dm->reclaim(ht_new);
-  //     },
-  //     ht_new, std::ref(checkpoints), snapshot_version, ID, std::ref(pages),
-  //     this);
-  // t.join();
+  if (full) remove_snapshot(ID, snapshot_version);
+}
+void DRAM_MemoryManager::close_snapshot() {
+  if (snapshot_segment == nullptr) return;
+  pmem_unmap(snapshot_segment, snapshot_size);
+  for (auto &&p : snapshot_pages) pmem_unmap(p.second, PAGE_SIZE);
+  snapshot_segment = nullptr;
+  snapshot_pages.clear();
 }
 void DRAM_MemoryManager::reclaim(Segment *ht_old) {
-  thread t(
-      [](Segment *seg, DRAM_MemoryManager *dm) {
-        // ensure there is no access on the old DPages.
-        {
-          lock_guard<mutex> guard_reclaim(RECLAIM_MTX);
-          RECLAIM.store(true);
-          WAIT_READ_LOCK();
-          RECLAIM.store(false);
-          RELEASE_READ_LOCK();
-        }
-        for (auto &&p : dm->pages) {
-          free(DPage_table[p]);
-          // std::cout << "Reclaim DPage: " << p << std::endl;
-          DPage_table[p] = nullptr;
-        }
-        free(seg->buckets);
-        free(seg);
-      },
-      ht_old, this);
-  t.detach();
+  // stop the lazy loader from copying into the reclaimed DRAM.
+  if (LAZY_LOADING.load()) {
+    if (ht_old->lazy) ht_old->lazy->dead = true;
+    for (auto &&p : pages)
+      if (DPage_lazy[p]) DPage_lazy[p]->dead = true;
+  }
+  // ensure there is no access on the old DPages.
+  epoch_manager.retire([ht_old, this]() {
+    for (auto &&p : pages) {
+      free(DPage_table[p]);
+      // std::cout << "Reclaim DPage: " << p << std::endl;
+      DPage_table[p] = nullptr;
+    }
+    close_snapshot();
+    free(ht_old->buckets);
+    free((void *)ht_old->dirty);
+    free(ht_old);
+  });
 }
 
 void PM_MemoryManager::update_metadata() {
@@ -245,7 +716,8 @@ void PM_MemoryManager::update_metadata() {
 }
 void PM_MemoryManager::creat_new_space() {
   lock_guard<mutex> guard(PM_MemoryManager::mtx);
-  if (base_addr) {
+  // a restored manager may hold a PPage without room left.
+  if (base_addr && local_offset <= PAGE_SIZE) {
     update_metadata();
     // halo_write_count += 1;
   }
@@ -259,6 +731,7 @@ void PM_MemoryManager::creat_new_space() {
   page_metadata->PAGEID = current_PAGE_ID;
   page_metadata->LOCAL_OFFSET = PRESERVE_SIZE_EACH_PAGE;
   page_metadata->FREED = 0;
+  free_space.set(current_PAGE_ID, 0);
   page_metadata->ALLOCATOR_ID = ID;
   // if crash here, this PPage will be deleted during recovery
   pmem_persist(base_addr, PRESERVE_SIZE_EACH_PAGE);
@@ -275,7 +748,6 @@ void PM_MemoryManager::creat_new_space() {
 }
 
 PM_MemoryManager::~PM_MemoryManager() {
-  RECLAIM_LOCK[ID] = false;
   if (ID != -1) memory_manager_Pool.log_out(this);
 }
 pair<size_t, char *> PM_MemoryManager::halloc(size_t size) {
@@ -289,12 +761,132 @@ pair<size_t, char *> PM_MemoryManager::halloc(size_t size) {
     }
   }
 }
+// bytes freed by this thread not yet added to free_space
+struct FreedCache {
+  size_t page[FREED_CACHE_SIZE];
+  size_t bytes[FREED_CACHE_SIZE];
+  FreedCache() { std::fill(page, page + FREED_CACHE_SIZE, INVALID); }
+  ~FreedCache() { free_space.publish(); }
+};
+static thread_local FreedCache freed_cache;
+
+size_t FreeSpace::add(size_t page_id, size_t bytes) {
+  auto &c = freed_cache;
+  auto i = page_id % FREED_CACHE_SIZE;
+  if (c.page[i] != page_id) {
+    if (c.page[i] != INVALID) freed[c.page[i]].fetch_add(c.bytes[i]);
+    c.page[i] = page_id;
+    c.bytes[i] = 0;
+  }
+  c.bytes[i] += bytes;
+  if (c.bytes[i] >= FREED_PUBLISH_BYTES) {
+    auto total = freed[page_id].fetch_add(c.bytes[i]) + c.bytes[i];
+    c.bytes[i] = 0;
+    return total;
+  }
+  return freed[page_id].load(std::memory_order_relaxed) + c.bytes[i];
+}
+void FreeSpace::publish() {
+  auto &c = freed_cache;
+  for (size_t i = 0; i < FREED_CACHE_SIZE; i++) {
+    if (c.page[i] == INVALID) continue;
+    freed[c.page[i]].fetch_add(c.bytes[i]);
+    c.page[i] = INVALID;
+  }
+}
+void FreeSpace::persist() {
+  publish();
+  for (size_t i = 0; i < PM_MemoryManager::PAGE_ID; i++) {
+    auto addr = PPage_table[i].load();
+    if (addr == INVALID) continue;
+    auto metadata = reinterpret_cast<PAGE_METADATA *>(addr);
+    auto f = freed[i].load(std::memory_order_relaxed);
+    if (metadata->FREED == f) continue;
+    metadata->FREED = f;
+    pmem_flush(&metadata->FREED, sizeof(size_t));
+  }
+  pmem_drain();
+}
+void FreeSpace::load() {
+  for (size_t i = 0; i < PM_MemoryManager::PAGE_ID; i++) {
+    auto addr = PPage_table[i].load();
+    freed[i] = addr == INVALID
+                   ? 0
+                   : reinterpret_cast<PAGE_METADATA *>(addr)->FREED;
+  }
+}
+
+/* Copy 64 B to PM with non-temporal stores, dst is cache line aligned. */
+static inline void stream_cache_line(char *dst, const char *src) {
+#if defined(__AVX512F__)
+  _mm512_stream_si512(reinterpret_cast<__m512i *>(dst),
+                      _mm512_loadu_si512(src));
+#elif defined(__AVX__)
+  for (size_t i = 0; i < CACHE_LINE_SIZE; i += sizeof(__m256i))
+    _mm256_stream_si256(
+        reinterpret_cast<__m256i *>(dst + i),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i)));
+#else
+  for (size_t i = 0; i < CACHE_LINE_SIZE; i += sizeof(__m128i))
+    _mm_stream_si128(
+        reinterpret_cast<__m128i *>(dst + i),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+#endif
+}
+
+/**
+ * @brief Append len bytes at the next XPLine of the PPage with 64 B
+ * non-temporal stores, so every XPLine is written at once. The gaps before
+ * and after the bytes are padding records (op TRASH, version the padding
+ * length) of at least a header. The caller drains.
+ *
+ * @return the offset and the address of the bytes.
+ */
+pair<size_t, char *> PM_MemoryManager::append_xpline(const char *src,
+                                                     size_t len) {
+  auto pad = [](size_t n) {
+    if (n && n < sizeof(RECORD_HEADER)) n += XPLINE_SIZE;
+    return n;
+  };
+  auto total = ROUND_UP(len, XPLINE_SIZE);
+  auto tail = pad(total - len);
+  total = len + tail;
+  size_t lead;
+  while (true) {
+    lead = pad(ROUND_UP(local_offset, XPLINE_SIZE) - local_offset);
+    if (local_offset + lead + total < PAGE_SIZE) break;
+    creat_new_space();
+  }
+  if (lead) {
+    RECORD_HEADER h(OP_t::TRASH, lead);
+    pmem_memcpy_nodrain(base_addr + local_offset, &h, sizeof(h));
+    local_offset += lead;
+  }
+  auto dst = base_addr + local_offset;
+  auto body = len / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  for (size_t i = 0; i < body; i += CACHE_LINE_SIZE)
+    stream_cache_line(dst + i, src + i);
+  // the rest of the bytes and the padding record
+  alignas(CACHE_LINE_SIZE) char last[XPLINE_SIZE + CACHE_LINE_SIZE] = {0};
+  memcpy(last, src + body, len - body);
+  if (tail) {
+    RECORD_HEADER h(OP_t::TRASH, tail);
+    memcpy(last + len - body, &h, sizeof(h));
+  }
+  for (size_t i = 0; body + i < total; i += CACHE_LINE_SIZE)
+    stream_cache_line(dst + body + i, last + i);
+  auto offset = current_PAGE_ID * PAGE_SIZE + local_offset;
+  local_offset += total;
+  xpline_bytes.fetch_add(len, std::memory_order_relaxed);
+  xpline_count.fetch_add(total / XPLINE_SIZE, std::memory_order_relaxed);
+  return {offset, dst};
+}
+
 MemoryManagerPool::MemoryManagerPool() {
   thread_counter = 0;
 
   for (size_t i = 0; i < CORE_NUM; i++) {
     ppage_in_use[i] = INVALID;
-    RECLAIM_LOCK[CORE_NUM] = false;
   }
   for (size_t i = 0; i < MAX_PAGE_NUM; i++) {
     PPage_table[i] = INVALID;
@@ -303,42 +895,110 @@ MemoryManagerPool::MemoryManagerPool() {
 }
 void MemoryManagerPool::info() {}
 
+LazyRegion *MemoryManagerPool::add_lazy_region(void *dst, void *src,
+                                               size_t size) {
+  auto r = new LazyRegion(static_cast<char *>(dst), static_cast<char *>(src),
+                          size);
+  lazy_regions.push_back(r);
+  return r;
+}
+void MemoryManagerPool::load_lazily() {
+  Timer t;
+  t.start();
+  for (auto &&r : lazy_regions) {
+    for (size_t c = 0; c < r->chunks; c++) {
+      EpochGuard guard;
+      if (r->dead) break;
+      r->touch(r->dst + c * LAZY_CHUNK_SIZE);
+    }
+  }
+  LAZY_LOADING.store(false);
+  std::cout << "Lazy restart: " << lazy_regions.size()
+            << " snapshot files loaded in "
+            << t.elapsed<std::chrono::milliseconds>() << " ms." << endl;
+  // threads may still be touching the regions.
+  epoch_manager.retire([regions = std::move(lazy_regions)]() {
+    for (auto &&r : regions) {
+      pmem_unmap(r->src, r->size);
+      delete r;
+    }
+  });
+  lazy_regions.clear();
+}
+
 void MemoryManagerPool::shutdown(CLHT *clhts[TABLE_NUM]) {
   if (!SNAPSHOT) return;
-  vector<thread> t;
+  if (lazy_loader.joinable()) lazy_loader.join();
+  // the calling thread is still registered, save its PPage state.
+  if (mmanager.ID != -1) {
+    log_out(&mmanager);
+    mmanager.ID = -1;
+  }
+  Timer timer;
+  timer.start();
+  // copies with non-temporal stores, run by a pool of workers.
+  vector<std::function<void()>> writes;
+  vector<pair<void *, size_t>> files;
+  size_t bytes = 0;
+  auto stream = [](char *dst, const char *src, size_t len) {
+    pmem_memcpy(dst, src, len, PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+    pmem_drain();
+  };
+  unswizzle_chains(clhts);
   for (size_t i = 0; i < TABLE_NUM; i++) {
     auto clht = clhts[i];
     auto &dm = clht->table->hallocD;
+    dm->close_snapshot();
     auto verion = ++dm->snapshot_version;
     auto sz = clht->table->num_buckets;
     // store segment
     auto name =
         generate_filename(PM_FILE_NAME::SEGMENT_SNAPSHOT, verion, dm->ID);
-    // printf("\nSnapshot segment:%s %lu\n", name.c_str(), sz * sizeof(Bucket));
-    auto addr = MemoryManager::map_pm_file(sz * sizeof(Bucket), name);
-    t.push_back(std::thread([addr, clht, sz]() {
-      memcpy(addr, clht->table->buckets, sz * sizeof(Bucket));
-      pmem_deep_persist(addr, sz * sizeof(Bucket));
-      pmem_unmap(addr, sz * sizeof(Bucket));
-    }));
-
+    auto addr = static_cast<char *>(
+        MemoryManager::map_pm_file(sz * sizeof(Bucket), name));
+    files.push_back({addr, sz * sizeof(Bucket)});
+    writes.push_back([addr, clht, sz, stream]() {
+      stream(addr, reinterpret_cast<char *>(clht->table->buckets),
+             sz * sizeof(Bucket));
+    });
+    bytes += sz * sizeof(Bucket);
     halo_count2 += sz;
-    // store DPage
+
+    // store the used prefix of the DPages in one file
+    if (dm->pages.empty()) continue;
+    vector<DPAGE_PACK_ENTRY> entries;
+    auto offset = ROUND_UP(sizeof(size_t) + dm->pages.size() *
+                                                sizeof(DPAGE_PACK_ENTRY),
+                           DPAGE_PACK_ALIGN);
     for (auto &&p : dm->pages) {
-      auto name2 =
-          generate_filename(PM_FILE_NAME::DPAGE_SNAPSHOT, verion, dm->ID, p);
-      auto addr = MemoryManager::map_pm_file(PAGE_SIZE, name2);
-      // printf("\nSnapshot DPage: %lu,%s \n", p, name2.c_str());
-      t.push_back(std::thread([addr, p]() {
-        memcpy(addr, DPage_table[p], PAGE_SIZE);
-        pmem_deep_persist(addr, PAGE_SIZE);
-        pmem_unmap(addr, PAGE_SIZE);
-      }));
+      auto used =
+          p == dm->current_PAGE_ID
+              ? dm->local_offset
+              : reinterpret_cast<PAGE_METADATA *>(DPage_table[p])->LOCAL_OFFSET;
+      used = std::clamp(used, PRESERVE_SIZE_EACH_PAGE, PAGE_SIZE);
+      entries.push_back({p, offset, used});
+      offset += ROUND_UP(used, DPAGE_PACK_ALIGN);
       halo_count3++;
     }
+    auto pack = static_cast<char *>(MemoryManager::map_pm_file(
+        offset,
+        generate_filename(PM_FILE_NAME::DPAGE_SNAPSHOT, verion, dm->ID)));
+    files.push_back({pack, offset});
+    *reinterpret_cast<size_t *>(pack) = entries.size();
+    memcpy(pack + sizeof(size_t), entries.data(),
+           entries.size() * sizeof(DPAGE_PACK_ENTRY));
+    pmem_persist(pack, sizeof(size_t) + entries.size() * sizeof(DPAGE_PACK_ENTRY));
+    for (auto &&e : entries) {
+      writes.push_back([pack, e, stream]() {
+        stream(pack + e.OFFSET, DPage_table[e.PAGEID], e.SIZE);
+      });
+      bytes += e.SIZE;
+    }
   }
-  for (auto &&i : t) i.join();
-  t.clear();
+  parallel_for(writes.size(), [&writes](size_t i) { writes[i](); });
+  for (auto &&f : files) pmem_unmap(f.first, f.second);
+  std::cout << "Snapshot: " << bytes / 1024 / 1024 << " MB written, cost "
+            << timer.elapsed<std::chrono::milliseconds>() << " ms." << endl;
 
   for (size_t i = 0; i < TABLE_NUM; i++) {
     auto &dm = clhts[i]->table->hallocD;
@@ -350,6 +1010,10 @@ void MemoryManagerPool::shutdown(CLHT *clhts[TABLE_NUM]) {
   for (size_t i = 0; i < CORE_NUM; i++) {
     ROOT->CURRENT_PPAGE_ID[i] = pm[i].current_PAGE_ID;
     ROOT->CURRENT_PPAGE_OFFSET[i] = pm[i].local_offset;
+    // the snapshot covers the whole log
+    for (size_t j = 0; j < TABLE_NUM; j++)
+      ROOT->SEGMENT_CHECKPOINT[j][i] =
+          pm[i].current_PAGE_ID == INVALID ? 0 : pm[i].current_PAGE_ID;
   }
   ROOT->DPAGE_ID = DRAM_MemoryManager::PAGE_ID;
   ROOT->PPAGE_ID = PM_MemoryManager::PAGE_ID;
@@ -359,29 +1023,94 @@ void MemoryManagerPool::shutdown(CLHT *clhts[TABLE_NUM]) {
   pmem_unmap(ROOT, METADATA_SIZE);
   for (size_t i = 0; i < TABLE_NUM; i++) {
     auto &dm = clhts[i]->table->hallocD;
-    filesystem::remove_all(generate_filename(PM_FILE_NAME::DPAGE_SNAPSHOT,
-                                             dm->snapshot_version - 1, dm->ID));
-    filesystem::remove_all(generate_filename(PM_FILE_NAME::SEGMENT_SNAPSHOT,
-                                             dm->snapshot_version - 1, dm->ID));
+    remove_snapshot(dm->ID, dm->snapshot_version);
   }
 }
 
+/* Allocate a restored DPage, its header is loaded first to find its id. */
+static char *alloc_DPage(size_t page_id, const char *src) {
+  auto page = static_cast<char *>(aligned_alloc(PAGE_SIZE, PAGE_SIZE));
+  memcpy(page, src, PRESERVE_SIZE_EACH_PAGE);
+  reinterpret_cast<PAGE_METADATA *>(page)->PAGEID = page_id;
+  return page;
+}
+/**
+ * @brief Restore the DPages of a packed snapshot file into DPage_table.
+ *
+ * @param filename the packed file of a sub-table.
+ * @param dm the DRAM manager of the sub-table.
+ * @param copies the copies to run, unless the DPages are loaded lazily.
+ * @param lazy load the DPages on demand.
+ * @return the restored DPage ids.
+ */
+std::vector<size_t> MemoryManagerPool::load_packed_dpages(
+    const string &filename, DRAM_MemoryManager *dm,
+    vector<std::function<void()>> &copies, bool lazy) {
+  std::vector<size_t> ids;
+  auto size = filesystem::file_size(filename);
+  auto pack = static_cast<char *>(MemoryManager::map_pm_file(size, filename));
+  auto num = *reinterpret_cast<size_t *>(pack);
+  auto entries = reinterpret_cast<DPAGE_PACK_ENTRY *>(pack + sizeof(size_t));
+  // the DPages follow the index, each holds at least its header
+  auto index_end = sizeof(size_t) + num * sizeof(DPAGE_PACK_ENTRY);
+  bool valid = num > 0 && num <= MAX_PAGE_NUM && index_end <= size;
+  for (size_t i = 0; valid && i < num; i++) {
+    auto e = entries[i];
+    valid = e.PAGEID < MAX_PAGE_NUM && e.OFFSET >= index_end &&
+            e.OFFSET % DPAGE_PACK_ALIGN == 0 &&
+            e.SIZE >= PRESERVE_SIZE_EACH_PAGE && e.SIZE <= PAGE_SIZE &&
+            e.SIZE <= size && e.OFFSET <= size - e.SIZE;
+  }
+  if (!valid) {
+    cerr << "Corrupt DPage snapshot " << filename << ", not loaded." << endl;
+    pmem_unmap(pack, size);
+    return ids;
+  }
+  for (size_t i = 0; i < num; i++) {
+    auto e = entries[i];
+    auto src = pack + e.OFFSET;
+    dm->pages.push_back(e.PAGEID);
+    DPage_table[e.PAGEID] = alloc_DPage(e.PAGEID, src);
+    if (lazy)
+      DPage_lazy[e.PAGEID] =
+          add_lazy_region(DPage_table[e.PAGEID] + PRESERVE_SIZE_EACH_PAGE,
+                          src + PRESERVE_SIZE_EACH_PAGE,
+                          e.SIZE - PRESERVE_SIZE_EACH_PAGE);
+    else
+      copies.push_back([e, src]() {
+        memcpy(DPage_table[e.PAGEID] + PRESERVE_SIZE_EACH_PAGE,
+               src + PRESERVE_SIZE_EACH_PAGE, e.SIZE - PRESERVE_SIZE_EACH_PAGE);
+        pmem_unmap(src, e.SIZE);
+      });
+    ids.push_back(e.PAGEID);
+  }
+  // every DPage unmaps its own range, the index is not needed any more.
+  auto index = entries[0].OFFSET;
+  pmem_unmap(pack, index);
+  return ids;
+}
+
 void MemoryManagerPool::creat() {
   filesystem::create_directory(PM_PATH);
   ROOT = static_cast<root *>(
       MemoryManager::map_pm_file(METADATA_SIZE, PM_PATH + "ROOT"));
 }
 
-std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
+std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM],
+                                               record_hkey_t hkey) {
   ROOT = static_cast<root *>(
       MemoryManager::map_pm_file(METADATA_SIZE, PM_PATH + "ROOT"));
+  Timer timer;
+  timer.start();
 
   // Recover PPage_table
+  size_t next_PPage_id = 0;
   for (auto &&entry : filesystem::recursive_directory_iterator(PM_PATH)) {
     string name = entry.path().filename();
     if (name[0] == PM_FILE_NAME::PPAGE) {
       auto s = split(name, "_");
       auto page_id = stoull(s[1]);
+      next_PPage_id = std::max<size_t>(next_PPage_id, page_id + 1);
       if (PPage_table[page_id].load() == UINT64_MAX) {
         auto addr = static_cast<char *>(
             MemoryManager::map_pm_file(PAGE_SIZE, entry.path()));
@@ -390,13 +1119,29 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
     }
   }
 
-  PM_MemoryManager::PAGE_ID = ROOT->PPAGE_ID;
+  // ROOT->PPAGE_ID may lag behind the last created PPage after a crash.
+  PM_MemoryManager::PAGE_ID = std::max(ROOT->PPAGE_ID, next_PPage_id);
+  free_space.load();
 
   vector<size_t> checkpoint(CORE_NUM);
-  vector<thread> t;
+  // copies from the snapshot files, run by a pool of workers.
+  vector<std::function<void()>> copies;
+  size_t files = 0;
+  auto run_copies = [&copies, &files](const char *phase, Timer &timer) {
+    parallel_for(copies.size(), [&copies](size_t i) { copies[i](); });
+    std::cout << "Recover " << phase << ": " << files << " files, cost "
+              << timer.elapsed<std::chrono::milliseconds>() << " ms." << endl;
+    copies.clear();
+    files = 0;
+    timer.start();
+  };
 
   std::cout << "Boot from "
             << (ROOT->clean ? "Normal Shutdown." : "System Crash.") << endl;
+  std::cout << "Recover PPage_table: " << PM_MemoryManager::PAGE_ID
+            << " PPages, cost " << timer.elapsed<std::chrono::milliseconds>()
+            << " ms." << endl;
+  timer.start();
 
   if (ROOT->clean) {
     // Recover Halloc-P
@@ -404,8 +1149,10 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
       for (size_t i = 0; i < CORE_NUM; i++) {
         pm[i].current_PAGE_ID = ROOT->CURRENT_PPAGE_ID[i];
         pm[i].local_offset = ROOT->CURRENT_PPAGE_OFFSET[i];
-        pm[i].base_addr =
-            reinterpret_cast<char *>(PPage_table[pm[i].current_PAGE_ID].load());
+        // a thread may never have allocated a PPage
+        if (pm[i].current_PAGE_ID < MAX_PAGE_NUM)
+          pm[i].base_addr = reinterpret_cast<char *>(
+              PPage_table[pm[i].current_PAGE_ID].load());
       }
     }
 
@@ -421,11 +1168,17 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
           if (version == ROOT->SS[segmend_id].SNAPSHOT_VERSION) {
             auto addr = static_cast<uint8_t *>(MemoryManager::map_pm_file(
                 table_size * sizeof(Bucket), entry.path()));
-            auto table = new CLHT(table_size, segmend_id, version, false);
-            t.push_back(std::thread([addr, table, table_size]() {
-              memcpy(table->table->buckets, addr, table_size * sizeof(Bucket));
-              pmem_unmap(addr, table_size * sizeof(Bucket));
-            }));
+            auto table = new CLHT(table_size, segmend_id, version, false, hkey);
+            files++;
+            if (LAZY_RESTART)
+              table->table->lazy = add_lazy_region(
+                  table->table->buckets, addr, table_size * sizeof(Bucket));
+            else
+              copies.push_back([addr, table, table_size]() {
+                memcpy(table->table->buckets, addr,
+                       table_size * sizeof(Bucket));
+                pmem_unmap(addr, table_size * sizeof(Bucket));
+              });
 
             clhts[segmend_id] = table;
 
@@ -435,6 +1188,7 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
           }
         }
       }
+      run_copies("Segment", timer);
     }
 
     // Recover Halloc-D
@@ -454,6 +1208,19 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
           auto s = split(name, "_");
           auto version = stoull(s[1]);
           auto aid = stoul(s[2]);
+          if (s.size() == 3) {
+            // packed by shutdown
+            if (ROOT->SS[aid].SNAPSHOT_VERSION != version) {
+              filesystem::remove(entry.path());
+              continue;
+            }
+            halo_count1 += load_packed_dpages(entry.path(),
+                                              clhts[aid]->table->hallocD,
+                                              copies, LAZY_RESTART)
+                               .size();
+            files++;
+            continue;
+          }
           auto page_id = stoull(s[3]);
           auto addr = static_cast<PAGE_METADATA *>(
               MemoryManager::map_pm_file(PAGE_SIZE, entry.path()));
@@ -465,24 +1232,50 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
           }
           clhts[aid]->table->hallocD->pages.push_back(page_id);
           DPage_table[page_id] =
-              static_cast<char *>(aligned_alloc(CACHE_LINE_SIZE, PAGE_SIZE));
-          t.push_back(thread([page_id, addr]() {
-            memcpy(DPage_table[page_id], addr, PAGE_SIZE);
-            pmem_unmap(addr, PAGE_SIZE);
-          }));
+              alloc_DPage(page_id, reinterpret_cast<char *>(addr));
+          files++;
+          if (LAZY_RESTART)
+            DPage_lazy[page_id] = add_lazy_region(
+                DPage_table[page_id] + PRESERVE_SIZE_EACH_PAGE,
+                reinterpret_cast<char *>(addr) + PRESERVE_SIZE_EACH_PAGE,
+                PAGE_SIZE - PRESERVE_SIZE_EACH_PAGE);
+          else
+            copies.push_back([page_id, addr]() {
+              memcpy(DPage_table[page_id] + PRESERVE_SIZE_EACH_PAGE,
+                     reinterpret_cast<char *>(addr) + PRESERVE_SIZE_EACH_PAGE,
+                     PAGE_SIZE - PRESERVE_SIZE_EACH_PAGE);
+              pmem_unmap(addr, PAGE_SIZE);
+            });
           halo_count1++;
         }
       }
+      run_copies("DPage", timer);
+      for (size_t i = 0; i < TABLE_NUM; i++) {
+        auto dm = clhts[i]->table->hallocD;
+        // a sub-table may never have allocated a DPage
+        dm->base_addr = dm->current_PAGE_ID < MAX_PAGE_NUM
+                            ? DPage_table[dm->current_PAGE_ID]
+                            : nullptr;
+        if (dm->base_addr == nullptr) dm->local_offset = PAGE_SIZE + 1;
+      }
+      // lazily loaded buckets are linked by addresses as they are copied
+      if (!LAZY_RESTART) swizzle_chains(clhts, false);
+    }
+
+    // the rest of the snapshot is loaded in the background
+    if (!lazy_regions.empty()) {
+      LAZY_LOADING.store(true);
+      lazy_loader = thread(&MemoryManagerPool::load_lazily, this);
     }
-    for (auto &&i : t) i.join();
-    t.clear();
 
   } else {
     // Recover Halloc-P
     {
       for (size_t i = 0; i < CORE_NUM; i++) {
         pm[i].current_PAGE_ID = ROOT->CURRENT_PPAGE_ID[i];
-        auto p = PPage_table[pm[i].current_PAGE_ID].load();
+        auto p = pm[i].current_PAGE_ID < MAX_PAGE_NUM
+                     ? PPage_table[pm[i].current_PAGE_ID].load()
+                     : INVALID;
         if (p != INVALID) {
           pm[i].local_offset =
               reinterpret_cast<PAGE_METADATA *>(p)->LOCAL_OFFSET;
@@ -503,24 +1296,25 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
           if (version == ROOT->SS[segment_id].SNAPSHOT_VERSION) {
             auto addr = static_cast<uint8_t *>(MemoryManager::map_pm_file(
                 table_size * sizeof(Bucket), entry.path()));
-            auto table = new CLHT(table_size, segment_id, version, false);
-            auto cp = [&](void *dst, void *src, size_t sz) {
-              memcpy(dst, src, sz);
-              pmem_unmap(src, table_size * sizeof(Bucket));
-            };
-            t.push_back(thread(cp, table->table->buckets, addr,
-                               table_size * sizeof(Bucket)));
+            auto table = new CLHT(table_size, segment_id, version, false, hkey);
+            files++;
+            copies.push_back([addr, table, table_size]() {
+              memcpy(table->table->buckets, addr, table_size * sizeof(Bucket));
+              pmem_unmap(addr, table_size * sizeof(Bucket));
+              // a checkpoint may have copied a bucket while it was locked
+              for (size_t i = 0; i < table_size; i++)
+                table->table->buckets[i].lock = LOCK_FREE;
+            });
             clhts[segment_id] = table;
           } else {
             filesystem::remove(entry.path());
           }
         }
       }
-      for (auto &&i : t) i.join();
-      t.clear();
+      run_copies("Segment", timer);
       for (size_t i = 0; i < TABLE_NUM; i++) {
         if (clhts[i] == nullptr)
-          clhts[i] = new CLHT(DEAFULT_SEGMENT_SIZE, i, 0, true);
+          clhts[i] = new CLHT(DEAFULT_SEGMENT_SIZE, i, 0, true, hkey);
       }
     }
 
@@ -531,8 +1325,19 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
         string name = entry.path().filename();
         if (name[0] == PM_FILE_NAME::DPAGE_SNAPSHOT) {
           auto s = split(name, "_");
-          auto aid = stoul(s[1]);
-          auto version = stoull(s[2]);
+          auto version = stoull(s[1]);
+          auto aid = stoul(s[2]);
+          if (s.size() == 3) {
+            if (ROOT->SS[aid].SNAPSHOT_VERSION != version) {
+              filesystem::remove(entry.path());
+            } else {
+              auto ids = load_packed_dpages(
+                  entry.path(), clhts[aid]->table->hallocD, copies, false);
+              for (auto &&id : ids) next_DPage_id = std::max(next_DPage_id, id);
+              files++;
+            }
+            continue;
+          }
           auto page_id = stoull(s[3]);
           next_DPage_id = next_DPage_id < page_id ? page_id : next_DPage_id;
           auto addr = static_cast<PAGE_METADATA *>(
@@ -543,20 +1348,22 @@ std::vector<size_t> MemoryManagerPool::startup(CLHT *clhts[TABLE_NUM]) {
           } else {
             clhts[aid]->table->hallocD->pages.push_back(page_id);
             DPage_table[page_id] =
-                static_cast<char *>(aligned_alloc(CACHE_LINE_SIZE, PAGE_SIZE));
-            auto cp = [](void *dst, void *src) {
-              memcpy(dst, src, PAGE_SIZE);
-              pmem_unmap(dst, PAGE_SIZE);
-            };
-            t.push_back(thread(cp, DPage_table[page_id], addr));
+                alloc_DPage(page_id, reinterpret_cast<char *>(addr));
+            files++;
+            copies.push_back([page_id, addr]() {
+              memcpy(DPage_table[page_id] + PRESERVE_SIZE_EACH_PAGE,
+                     reinterpret_cast<char *>(addr) + PRESERVE_SIZE_EACH_PAGE,
+                     PAGE_SIZE - PRESERVE_SIZE_EACH_PAGE);
+              pmem_unmap(addr, PAGE_SIZE);
+            });
           }
         }
       }
       DRAM_MemoryManager::PAGE_ID = next_DPage_id + 1;
+      run_copies("DPage", timer);
+      swizzle_chains(clhts, true);
     }
-    for (auto &&i : t) i.join();
-    t.clear();
-    // Recover DPage_table and DPage
+    // Recover checkpoints
     {
       for (size_t i = 0; i < CORE_NUM; i++) {
         checkpoint[i] = ROOT->SEGMENT_CHECKPOINT[0][i];
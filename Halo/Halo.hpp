@@ -1,17 +1,23 @@
 #pragma once
 
 #include <emmintrin.h>
+#include <immintrin.h>
 #include <libpmem.h>
 #include <malloc.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <queue>
 #include <set>
 #include <shared_mutex>
 #include <string>
@@ -36,20 +42,51 @@ using namespace std;
 #define GET_CLHT_INDEX(kh, n) ((kh >> 56) % n)
 #define ROUND_UP(s, n) (((s) + (n)-1) & (~(n - 1)))
 constexpr size_t MAX_BATCHING_SIZE = 256;
+// concurrent inserts are written to PM in one batch by a combiner thread.
+constexpr bool GROUP_COMMIT = false;
+constexpr size_t XPLINE_SIZE = 256;
+// batches start at an XPLine and their last XPLine is padded, written with
+// 64 B non-temporal stores.
+constexpr bool XPLINE_LOG = false;
+constexpr size_t GROUP_COMMIT_MAX_SIZE = 64 * XPLINE_SIZE;
+// inserts are buffered per thread and written in one batch. The batch grows
+// under load and shrinks when the time bound flushes it.
+constexpr bool WRITE_BATCHING = false;
+constexpr size_t MIN_BATCHING_SIZE = 64;
+constexpr size_t BATCH_FLUSH_BOUND = 50 /* microseconds */;
+// deletes append a tombstone to the log instead of marking the deleted record
+// in place. The tombstone stays indexed until the cleaner drops it.
+constexpr bool TOMBSTONE_DELETE = false;
 constexpr size_t READ_BUFFER_SIZE = 16 /* Pairs */;
+constexpr size_t MULTIGET_BATCH_SIZE = 64 /* Pairs */;
 // constexpr size_t READ_BUFFER_SIZE = 1 /* Pairs */;
 
 using clht_val_t = volatile size_t;
 using clht_lock_t = volatile uint8_t;
 constexpr int CACHE_LINE_SIZE = 64;
-constexpr int ENTRIES_PER_BUCKET = 3;
-enum LOCK_STATE { LOCK_FREE = 0, LOCK_UPDATE = 1, LOCK_RESIZE = 2 };
+// buckets hold 16-bit hash tags and 48-bit PM offsets, 6 entries per line
+// instead of 3 full hashes and offsets. A tag match is verified by hashing
+// the key of its record.
+constexpr bool TAGGED_BUCKET = false;
+constexpr int ENTRIES_PER_BUCKET = TAGGED_BUCKET ? 6 : 3;
+enum LOCK_STATE {
+  LOCK_FREE = 0,
+  LOCK_UPDATE = 1,
+  LOCK_RESIZE = 2,
+  LOCK_MIGRATED = 3
+};
 constexpr int CLHT_PERC_EXPANSIONS = 1;
 constexpr int CLHT_MAX_EXPANSIONS = 24;
 constexpr int CLHT_PERC_FULL_DOUBLE = 50; /* % */
 constexpr int CLHT_OCCUP_AFTER_RES = 20;
 constexpr int CLHT_PERC_FULL_HALVE = 5; /* % */
 constexpr int CLHT_RATIO_HALVE = 8;
+// a sub-table is not halved below this many buckets
+constexpr size_t CLHT_MIN_BUCKETS = 1024;
+// bins a delete samples to estimate the load of its sub-table
+constexpr size_t CLHT_SHRINK_SAMPLE = 1024;
+// buckets migrated by a thread each time it helps a resize
+constexpr size_t RESIZE_CHUNK_SIZE = 1024;
 
 extern string PM_PATH;
 constexpr size_t PAGE_SIZE = 64ULL * 1024 * 1024 /* bytes */;
@@ -63,55 +100,207 @@ constexpr size_t CORE_NUM = 128;
 
 struct root;
 constexpr float CLEAN_THRESHOLD = 60;
+constexpr size_t GC_THREAD_NUM = 2;
+constexpr size_t GC_RATE_LIMIT = 256 * 1024 * 1024 /* bytes per second */;
+// relocated records updated at least this often are grouped as hot.
+constexpr uint32_t HOT_VERSION_THRESHOLD = 4;
 class PM_MemoryManager;
 class DRAM_MemoryManager;
 class MemoryManagerPool;
 class Segment;
 class CLHT;
-char *get_DPage_addr(size_t offset);
+class Checkpointer;
+class BatchFlusher;
+struct LazyRegion;
+// the DPage offset of a bucket linked by its DRAM address, for snapshots
+size_t get_DPage_offset(size_t next);
+// load the DPage chunk holding a bucket after a lazy restart
+void touch_DPage(const volatile void *addr);
 constexpr size_t MAX_BUFFER_PAIR_SIZE = 32;
 constexpr size_t MAX_WRITE_BUFFER_SIZE = 2048;
-constexpr size_t MAX_PAIR = 16;
 extern MemoryManagerPool memory_manager_Pool;
 extern thread_local PM_MemoryManager mmanager;
-extern thread_local int *INSERT_RESULT_POINTER[MAX_BUFFER_PAIR_SIZE];
-extern thread_local size_t WRITE_BUFFER_COUNTER;
 extern thread_local char WRITE_BUFFER[MAX_WRITE_BUFFER_SIZE];
-extern thread_local size_t WRITE_BUFFER_SIZE;
-extern thread_local size_t WRITE_PASS_COUNT;
 extern thread_local void *BUFFER_READ[READ_BUFFER_SIZE];
 extern thread_local size_t BUFFER_READ_COUNTER;
-enum INSERT_STATE { EXIST = -1, INSERTING = 0, DONE = 1 };
+enum INSERT_STATE { NOT_FOUND = -2, EXIST = -1, INSERTING = 0, DONE = 1 };
 extern root *ROOT;
 extern atomic_size_t PPage_table[MAX_PAGE_NUM];
+// the key hash of the record at a log offset, each Halo passes its own
+using record_hkey_t = size_t (*)(size_t offset);
+
+// bytes a thread frees in a PPage before it adds them to the shared counter
+constexpr size_t FREED_PUBLISH_BYTES = 64 * 1024;
+constexpr size_t FREED_CACHE_SIZE = 16 /* PPages */;
+/**
+ * @brief The bytes freed in each PPage, kept in DRAM. A thread sums the bytes
+ * it frees in a small cache of PPages and adds them to the shared counter in
+ * chunks, so deleters of the same PPage rarely meet. FREED in the PPage header
+ * is a lazy copy written by checkpoints and at shutdown, PPages replayed after
+ * a crash are counted again from the record ops.
+ *
+ */
+class FreeSpace {
+ public:
+  // returns an estimate of the bytes freed in the PPage
+  size_t add(size_t page_id, size_t bytes);
+  void set(size_t page_id, size_t bytes) { freed[page_id].store(bytes); }
+  // add the bytes cached by the calling thread
+  void publish();
+  // copy the counters to the PPage headers
+  void persist();
+  // load the counters from the PPage headers
+  void load();
+
+ private:
+  atomic_size_t freed[MAX_PAGE_NUM];
+};
+extern FreeSpace free_space;
 
 // for reclaim
-extern std::mutex RECLAIM_MTX;
-extern atomic_bool RECLAIM;
-extern std::vector<thread> reclaim_threads;
-extern std::mutex thread_mutex;
-extern bool RECLAIM_LOCK[CORE_NUM];
+constexpr size_t EPOCH_INACTIVE = UINT64_MAX;
+/**
+ * @brief Epoch-based reclamation. A thread announces the global epoch in its
+ * own cacheline-padded slot when it enters an operation and clears it when it
+ * leaves, so readers never write a shared cacheline. Retired memory is freed
+ * by a background thread once every announced epoch is newer than the epoch
+ * it was retired in.
+ *
+ */
+class EpochManager {
+ public:
+  ~EpochManager() { stop(); }
+  // enter and exit may nest, only the outermost pair announces.
+  void enter();
+  void exit();
+  // run `f` once no thread can still access the retired memory.
+  void retire(std::function<void()> f);
+  // block until all retired memory is freed.
+  void drain();
+  void stop();
+  void unregister_thread(int id);
+
+ private:
+  struct Slot {
+    atomic_size_t epoch{EPOCH_INACTIVE};
+    atomic_bool used{false};
+  } ALIGNED(CACHE_LINE_SIZE);
+  int register_thread();
+  size_t min_epoch();
+  void collect();
+  Slot slots[CORE_NUM];
+  atomic_size_t global_epoch{0};
+  // <retire epoch, free function>
+  std::queue<pair<size_t, std::function<void()>>> retired;
+  size_t unfreed = 0;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::condition_variable cv_drain;
+  bool running = false;
+  thread collector;
+};
+extern EpochManager epoch_manager;
+class EpochGuard {
+ public:
+  EpochGuard() { epoch_manager.enter(); }
+  ~EpochGuard() { epoch_manager.exit(); }
+};
+// A record read in place from PM. The view adopts the epoch entered for the
+// lookup and holds it until it is destroyed, so the PPage behind key and value
+// is not cleaned meanwhile. It must be released by the thread that got it.
+class PairView {
+ public:
+  PairView() = default;
+  PairView(std::string_view k, std::string_view v)
+      : _key(k), _value(v), held(true) {}
+  PairView(PairView &&o) noexcept
+      : _key(o._key), _value(o._value), held(o.held) {
+    o.held = false;
+  }
+  PairView &operator=(PairView &&o) noexcept {
+    if (this != &o) {
+      release();
+      _key = o._key;
+      _value = o._value;
+      held = o.held;
+      o.held = false;
+    }
+    return *this;
+  }
+  PairView(const PairView &) = delete;
+  PairView &operator=(const PairView &) = delete;
+  ~PairView() { release(); }
+  explicit operator bool() const { return held; }
+  std::string_view key() const { return _key; }
+  std::string_view value() const { return _value; }
+  void release() {
+    if (!held) return;
+    held = false;
+    epoch_manager.exit();
+  }
+
+ private:
+  std::string_view _key;
+  std::string_view _value;
+  bool held = false;
+};
 
 constexpr bool SNAPSHOT = true;
 constexpr bool LOGCLEAN = false;
+// checkpoint the DRAM index periodically to bound the redo log after a crash.
+constexpr bool CHECKPOINT = true;
+constexpr size_t CHECKPOINT_INTERVAL = 10 /* seconds */;
+constexpr size_t CHECKPOINT_RATE_LIMIT = 512 * 1024 * 1024 /* bytes per second */;
+// buckets sharing a dirty flag
+constexpr size_t CHECKPOINT_CHUNK = 64;
+// overflow buckets a thread takes from a DPage at once
+constexpr size_t BUCKET_SLAB_SIZE = 64;
+// serve right after a normal restart, the snapshot is loaded on demand.
+constexpr bool LAZY_RESTART = true;
+constexpr size_t LAZY_CHUNK_SIZE = 64 * 1024 /* bytes */;
+extern atomic_bool LAZY_LOADING;
 
 extern std::atomic<uint64_t> halo_count;
 extern std::atomic<uint64_t> halo_count1;
 extern std::atomic<uint64_t> halo_count2;
 extern std::atomic<uint64_t> halo_count3;
 extern std::atomic<uint64_t> halo_write_count;
+// payload and XPLines written by append_xpline
+extern std::atomic<uint64_t> xpline_bytes;
+extern std::atomic<uint64_t> xpline_count;
 
-constexpr size_t DEAFULT_SEGMENT_SIZE = 16 * 1024 * 1024;
+/* The length of the record at addr, a padding record spans its version. */
+template <typename KEY, typename VALUE>
+inline size_t record_size(char *addr) {
+  auto h = reinterpret_cast<RECORD_HEADER *>(addr);
+  if (h->op == OP_t::TRASH && h->version) return h->version;
+  return reinterpret_cast<Pair_t<KEY, VALUE> *>(addr)->size();
+}
+
+/* The records an index entry points to after recovery. */
+inline bool indexed_op(OP_t op) {
+  return op == OP_t::INSERT || (TOMBSTONE_DELETE && op == OP_t::DELETED);
+}
+// the value of a tombstone is the PPage id of the record it deletes
+template <typename VALUE>
+constexpr size_t TOMBSTONE_VLEN =
+    std::is_same_v<VALUE, std::string> ? sizeof(uint32_t) : sizeof(VALUE);
+template <typename KEY, typename VALUE>
+inline size_t tombstone_target(char *addr) {
+  uint32_t page;
+  memcpy(&page, Pair_t<KEY, VALUE>::value_view(addr).data(), sizeof(page));
+  return page;
+}
 
-void READ_LOCK();
-void WAIT_READ_LOCK();
-void RELEASE_READ_LOCK();
+constexpr size_t DEAFULT_SEGMENT_SIZE = 16 * 1024 * 1024;
 
 struct SEGMENT_SIZE_AND_SNAPSHOT_VERSION {
   size_t SEGMENT_SIZE;
   size_t SNAPSHOT_VERSION;
 };
 std::vector<size_t> nphase();
+// run f(0), ..., f(n - 1) on a pool of workers, one per hardware thread.
+void parallel_for(size_t n, const std::function<void(size_t)> &f);
 struct root {
   SEGMENT_SIZE_AND_SNAPSHOT_VERSION
   SS[TABLE_NUM];  // the SEGMENT_SIZE and SNAPSHOT_VERSIONS belong to the
@@ -136,12 +325,24 @@ struct PAGE_METADATA {
   size_t RECLAIMED;
 };
 
+// A shutdown snapshot packs the used prefix of all DPages of a sub-table into
+// one file: the number of DPages and their entries, then the DPages, each at
+// an offset aligned to DPAGE_PACK_ALIGN.
+constexpr size_t DPAGE_PACK_ALIGN = 4096;
+struct DPAGE_PACK_ENTRY {
+  size_t PAGEID;
+  size_t OFFSET;
+  size_t SIZE;
+};
+
 class MemoryManager {
  public:
   MemoryManager() {
     status = false;
     local_offset = PAGE_SIZE + 1;
     base_addr = nullptr;
+    // no page until the first halloc
+    current_PAGE_ID = INVALID;
   };
   ~MemoryManager(){};
   virtual void creat_new_space() = 0;
@@ -166,7 +367,7 @@ class MemoryManager {
     return ptr;
   }
 
-  void delete_pm_file(size_t page_id);
+  static void delete_pm_file(size_t page_id, void *addr);
   bool status;
   char *base_addr;
   int ID;
@@ -187,6 +388,7 @@ class PM_MemoryManager : public MemoryManager {
   void update_metadata();
   void realloc(size_t page_id);
   virtual pair<size_t, char *> halloc(size_t size);
+  pair<size_t, char *> append_xpline(const char *src, size_t len);
   static size_t PAGE_ID;
   static mutex mtx;
 };
@@ -199,13 +401,32 @@ class DRAM_MemoryManager : public MemoryManager {
   }
   void creat_new_space();
   virtual pair<size_t, char *> halloc(size_t size);
+  // a freed bucket or one of the calling thread's slab, mostly without a lock
+  char *alloc_bucket();
+  // reuse a bucket unlinked from its chain once no reader can reach it
+  void free_bucket(char *bucket);
   size_t nphase();
   void clean();
-  void persist(Segment *, std::vector<size_t>);
+  void checkpoint(Segment *, const std::vector<size_t> &, Checkpointer &);
+  void close_snapshot();
   void reclaim(Segment *);
+  // bytes carved from the DPages so far
+  size_t allocated();
   std::vector<size_t> pages;
   size_t snapshot_version;
+  // the snapshot files of snapshot_version, updated in place by checkpoints.
+  char *snapshot_segment = nullptr;
+  size_t snapshot_size = 0;
+  std::map<size_t, char *> snapshot_pages;
   mutex alloc_mtx;
+  // the buckets each thread carved from the DPages, by epoch slot
+  struct Slab {
+    char *next = nullptr;
+    char *end = nullptr;
+  } ALIGNED(CACHE_LINE_SIZE);
+  Slab slabs[CORE_NUM];
+  // freed buckets, linked by their next field
+  std::atomic<char *> free_list{nullptr};
   static size_t PAGE_ID;
   static mutex mtx;
 };
@@ -222,7 +443,9 @@ class MemoryManagerPool {
         p->current_PAGE_ID = pm[i].current_PAGE_ID;
         p->local_offset = pm[i].local_offset;
         pm[i].status = true;
-        memory_manager_Pool.ppage_in_use[i] = p->current_PAGE_ID;
+        // a manager without a PPage yet does not pin PPage 0
+        memory_manager_Pool.ppage_in_use[i] =
+            p->base_addr ? p->current_PAGE_ID : INVALID;
         if (work) {
           thread_counter++;
           p->workthread = true;
@@ -247,8 +470,15 @@ class MemoryManagerPool {
     if (p->workthread) thread_counter--;
   }
   void init_MemoryManager(MemoryManager *m, int i);
-  std::vector<size_t> startup(CLHT *clhts[TABLE_NUM]);
+  std::vector<size_t> startup(CLHT *clhts[TABLE_NUM], record_hkey_t hkey);
   void shutdown(CLHT *clhts[TABLE_NUM]);
+  LazyRegion *add_lazy_region(void *dst, void *src, size_t size);
+  std::vector<size_t> load_packed_dpages(const string &filename,
+                                         DRAM_MemoryManager *dm,
+                                         vector<std::function<void()>> &copies,
+                                         bool lazy);
+  // copy the rest of the lazy regions and drop the snapshot mappings.
+  void load_lazily();
   void creat();
   void info();
   bool is_in_allocating(size_t page_id) {
@@ -261,21 +491,394 @@ class MemoryManagerPool {
   bool CURRENT_PPAGE_ID[CORE_NUM];
   size_t ppage_in_use[CORE_NUM];
   atomic_size_t thread_counter;
+  std::vector<LazyRegion *> lazy_regions;
+  thread lazy_loader;
   static mutex mtx_pm_pool;
 };
 
+/**
+ * @brief Token bucket that bounds the bytes written per second.
+ *
+ */
+class RateLimiter {
+ public:
+  RateLimiter() : rate(0), tokens(0) {}
+  void set_rate(size_t bytes_per_sec);
+  // block until `bytes` can be written without exceeding the rate.
+  void acquire(size_t bytes);
+
+ private:
+  size_t rate;
+  double tokens;
+  std::chrono::steady_clock::time_point last;
+  std::mutex mtx;
+};
+
+struct LogCleanerOptions {
+  size_t workers = GC_THREAD_NUM;
+  // a PPage is cleaned once the ratio of its live bytes drops below this (%).
+  float utilization_target = 100 - CLEAN_THRESHOLD;
+  // bytes moved per second by all workers, 0 means unlimited.
+  size_t rate_limit = GC_RATE_LIMIT;
+};
+
+/**
+ * @brief Log cleaner with a fixed pool of workers. Victim PPages are cleaned
+ * in the order of their freed bytes, the most freed first. Each worker
+ * relocates into its own cold and hot PPages, so the relocated records are
+ * not mixed with fresh writes and pages of similar lifetime die together.
+ *
+ */
+class LogCleaner {
+ public:
+  // move the live records out of a PPage into the cold or hot PPages and
+  // release it.
+  using Relocate = std::function<void(size_t page_id, PM_MemoryManager &cold,
+                                      PM_MemoryManager &hot)>;
+  ~LogCleaner() { stop(); }
+  void start(const LogCleanerOptions &opt, Relocate f);
+  void stop();
+  bool need_clean(size_t freed) {
+    return freed * 100 >= (100 - options.utilization_target) * PAGE_SIZE;
+  }
+  void submit(size_t page_id, size_t freed);
+  // account the bytes of a moved record, blocks if the rate is exceeded.
+  void throttle(size_t bytes, bool hot) {
+    bytes_moved += bytes;
+    if (hot) hot_bytes_moved += bytes;
+    limiter.acquire(bytes);
+  }
+  atomic_size_t bytes_moved{0};
+  atomic_size_t hot_bytes_moved{0};
+  atomic_size_t pages_freed{0};
+
+ private:
+  void work();
+  LogCleanerOptions options;
+  Relocate relocate;
+  // <freed bytes, page id>
+  std::priority_queue<pair<size_t, size_t>> victims;
+  // PPages queued, being cleaned or cleaned. A cleaned PPage stays mapped
+  // until its epoch passes and must not be cleaned twice.
+  std::set<size_t> pending;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool running = false;
+  std::vector<thread> workers;
+  RateLimiter limiter;
+};
+
+enum CHUNK_STATE { CHUNK_UNLOADED = 0, CHUNK_LOADING = 1, CHUNK_LOADED = 2 };
+/**
+ * @brief DRAM buckets restored from a mapped snapshot file. The region is split
+ * into chunks that are copied once, by the first thread touching them or by
+ * the background loader, which also turn the next offsets into addresses.
+ *
+ */
+struct LazyRegion {
+  LazyRegion(char *d, char *s, size_t sz)
+      : dst(d),
+        src(s),
+        size(sz),
+        chunks((sz + LAZY_CHUNK_SIZE - 1) / LAZY_CHUNK_SIZE),
+        state(new std::atomic<uint8_t>[chunks]) {
+    for (size_t i = 0; i < chunks; i++) state[i] = CHUNK_UNLOADED;
+  }
+  // load the chunk holding addr before it is accessed, buckets allocated
+  // past the restored ones need no loading.
+  void touch(const volatile void *addr) {
+    size_t c = (reinterpret_cast<const volatile char *>(addr) - dst) /
+               LAZY_CHUNK_SIZE;
+    if (c < chunks &&
+        state[c].load(std::memory_order_acquire) != CHUNK_LOADED)
+      fault(c);
+  }
+  void fault(size_t chunk);
+  char *dst;
+  char *src;
+  size_t size;
+  size_t chunks;
+  std::unique_ptr<std::atomic<uint8_t>[]> state;
+  // the DRAM was reclaimed, the loader skips the rest of the region.
+  atomic_bool dead{false};
+};
+/* Fault in a chunk of a lazily restored region before accessing it. */
+inline void lazy_touch(LazyRegion *r, const volatile void *addr) {
+  if (Unlikely(LAZY_LOADING.load(std::memory_order_relaxed)) && r)
+    r->touch(addr);
+}
+/* The bucket a next field links, nullptr at the end of the chain. */
+inline char *get_bucket_addr(size_t next) {
+  if (next == INVALID) return nullptr;
+  auto addr = reinterpret_cast<char *>(next);
+  if (Unlikely(LAZY_LOADING.load(std::memory_order_relaxed))) touch_DPage(addr);
+  return addr;
+}
+
+/**
+ * @brief Background checkpointer. Every interval it writes the buckets
+ * changed since the last checkpoint to the snapshot and advances the
+ * checkpoints of the redo log, at a bounded rate.
+ *
+ */
+class Checkpointer {
+ public:
+  ~Checkpointer() { stop(); }
+  void start(size_t interval, size_t rate_limit, std::function<void()> f);
+  void stop();
+  // account the bytes written, blocks if the rate is exceeded.
+  void throttle(size_t bytes) {
+    bytes_written += bytes;
+    limiter.acquire(bytes);
+  }
+  atomic_size_t bytes_written{0};
+  atomic_size_t checkpoints{0};
+
+ private:
+  void work();
+  std::function<void()> checkpoint;
+  size_t interval;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool running = false;
+  thread worker;
+  RateLimiter limiter;
+};
+
+/**
+ * @brief Group commit of PM records. An inserter publishes its record in its
+ * slot, then either waits or becomes the combiner, which copies all published
+ * records into one contiguous allocation, persists them with a single drain
+ * and wakes their owners with the offsets.
+ *
+ */
+class GroupCommit {
+ public:
+  // returns the PM offset of the record
+  size_t commit(const char *record, size_t len);
+  atomic_size_t batches{0};
+  atomic_size_t records{0};
+
+ private:
+  void combine();
+  struct Request {
+    std::atomic<const char *> record{nullptr};
+    size_t len;
+    size_t offset;
+    std::atomic_bool done{false};
+  } ALIGNED(CACHE_LINE_SIZE);
+  Request requests[CORE_NUM];
+  std::mutex combiner;
+};
+extern GroupCommit group_commit;
+
+/* The inserts buffered by a thread. */
+struct WriteBatch {
+  // held by the owner thread or the flusher
+  std::mutex mtx;
+  char buffer[MAX_WRITE_BUFFER_SIZE];
+  size_t size = 0;
+  size_t count = 0;
+  size_t hkeys[MAX_BUFFER_PAIR_SIZE];
+  uint32_t lens[MAX_BUFFER_PAIR_SIZE];
+  // set to DONE once the insert is durable
+  int *results[MAX_BUFFER_PAIR_SIZE];
+  // the entry a buffered tombstone replaces, INVALID for an insert
+  size_t olds[MAX_BUFFER_PAIR_SIZE];
+  // bytes that trigger a flush
+  size_t threshold = MAX_BATCHING_SIZE;
+  // arrival of the oldest buffered insert
+  std::atomic<uint64_t> since{0};
+  BatchFlusher *flusher = nullptr;
+  // the owner thread has exited
+  bool orphaned = false;
+};
+
+/**
+ * @brief Bounds the latency of batched inserts. Every write batch is
+ * registered on first use and a timer flushes the batches whose oldest
+ * insert is older than the bound, so the inserts of an idle thread become
+ * durable.
+ *
+ */
+class BatchFlusher {
+ public:
+  ~BatchFlusher() { stop(); }
+  void start(size_t bound_us, std::function<void(WriteBatch &)> f);
+  // flushes all batches
+  void stop();
+  // the batch of the calling thread
+  WriteBatch &local();
+  bool expired(const WriteBatch &b) const {
+    auto t = b.since.load(std::memory_order_relaxed);
+    return t && now() - t >= bound * 1000;
+  }
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  atomic_size_t timed_flushes{0};
+
+ private:
+  void work();
+  void flush_batches(bool all);
+  std::function<void(WriteBatch &)> flush;
+  size_t bound = BATCH_FLUSH_BOUND;
+  std::vector<WriteBatch *> batches;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool running = false;
+  thread worker;
+};
+
 static inline size_t hash_func(
     const void *k, size_t _len,
     size_t _seed = static_cast<size_t>(0xc70f6907UL)) {
   return std::_Hash_bytes(k, _len, _seed);
 }
-struct Bucket {
+/* 3 full key hashes and PM offsets per line. */
+struct WideBucket {
+  static constexpr int SLOTS = 3;
+  clht_lock_t lock;
+  uint32_t hops;
+  size_t key[SLOTS];
+  clht_val_t val[SLOTS];
+  // the DRAM address of the next bucket, its DPage offset in snapshots
+  volatile size_t next;
+
+  /**
+   * @brief The slot holding k, -1 if none. All keys are compared at once.
+   *
+   * @param v set to the offset of k, INVALID if the slot was reused while
+   * it was read.
+   */
+  int find(size_t k, record_hkey_t, size_t *v = nullptr) volatile {
+    int j = -1;
+#ifdef __AVX2__
+    // the 4 lanes cover the keys and val[0], which is masked off
+    auto keys = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(const_cast<size_t *>(key)));
+    auto eq = _mm256_cmpeq_epi64(keys, _mm256_set1_epi64x(k));
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq)) &
+               ((1 << SLOTS) - 1);
+    if (mask) j = __builtin_ctz(mask);
+#else
+    for (int i = 0; i < SLOTS && j < 0; i++)
+      if (key[i] == k) j = i;
+#endif
+    if (j >= 0 && v) {
+      *v = val[j];
+      // the key is written after the value, a reused slot has another key
+      if (key[j] != k) *v = INVALID;
+    }
+    return j;
+  }
+  int find_empty() volatile { return find(INVALID, nullptr); }
+  bool used(int j) volatile { return key[j] != INVALID; }
+  bool is_empty() volatile {
+    for (int j = 0; j < SLOTS; j++)
+      if (used(j)) return false;
+    return true;
+  }
+  size_t raw(int j) volatile { return key[j]; }
+  size_t hkey(int j, record_hkey_t) volatile { return key[j]; }
+  size_t value(int j) volatile { return val[j]; }
+  void set(int j, size_t k, size_t v) volatile {
+    val[j] = v;
+    key[j] = k;
+  }
+  void set_value(int j, size_t v) volatile { val[j] = v; }
+  void clear(int j) volatile {
+    key[j] = INVALID;
+    val[j] = INVALID;
+  }
+  WideBucket *next_bucket() volatile {
+    return reinterpret_cast<WideBucket *>(get_bucket_addr(next));
+  }
+  /* The next bucket of the chain, prefetched while this one is scanned. */
+  WideBucket *next_prefetched() volatile {
+    auto b = next_bucket();
+    if (b) _mm_prefetch(reinterpret_cast<const char *>(b), _MM_HINT_T0);
+    return b;
+  }
+} ALIGNED(CACHE_LINE_SIZE);
+static_assert(offsetof(WideBucket, key) + 4 * sizeof(size_t) <=
+                  sizeof(WideBucket),
+              "WideBucket::find loads 4 keys");
+
+/**
+ * @brief 6 tagged PM offsets per line. A slot is one word, bits 40..55 of
+ * the key hash over a 48-bit offset, so it is written and read atomically;
+ * the full hash of an entry is read from its record.
+ */
+struct TaggedBucket {
+  static constexpr int SLOTS = 6;
+  static constexpr size_t OFFSET_MASK = (1ULL << 48) - 1;
   clht_lock_t lock;
   uint32_t hops;
-  size_t key[ENTRIES_PER_BUCKET];
-  clht_val_t val[ENTRIES_PER_BUCKET];
+  volatile size_t slot[SLOTS];
+  // the DRAM address of the next bucket, its DPage offset in snapshots
   volatile size_t next;
+
+  // bits 56.. pick the sub-table and the low bits the bucket
+  static size_t tag(size_t k) { return k >> 40 << 48; }
+  int find(size_t k, record_hkey_t record_hkey,
+           size_t *v = nullptr) volatile {
+    auto t = tag(k);
+    for (int j = 0; j < SLOTS; j++) {
+      size_t w = slot[j];
+      if (w != INVALID && (w & ~OFFSET_MASK) == t &&
+          record_hkey(w & OFFSET_MASK) == k) {
+        if (v) *v = w & OFFSET_MASK;
+        return j;
+      }
+    }
+    return -1;
+  }
+  int find_empty() volatile {
+    for (int j = 0; j < SLOTS; j++)
+      if (slot[j] == INVALID) return j;
+    return -1;
+  }
+  bool used(int j) volatile { return slot[j] != INVALID; }
+  bool is_empty() volatile {
+    for (int j = 0; j < SLOTS; j++)
+      if (used(j)) return false;
+    return true;
+  }
+  size_t raw(int j) volatile { return slot[j]; }
+  size_t hkey(int j, record_hkey_t record_hkey) volatile {
+    return used(j) ? record_hkey(slot[j] & OFFSET_MASK) : INVALID;
+  }
+  size_t value(int j) volatile {
+    size_t w = slot[j];
+    return w == INVALID ? INVALID : w & OFFSET_MASK;
+  }
+  void set(int j, size_t k, size_t v) volatile { slot[j] = tag(k) | v; }
+  void set_value(int j, size_t v) volatile {
+    if (v == INVALID) clear(j);
+    else slot[j] = (slot[j] & ~OFFSET_MASK) | v;
+  }
+  void clear(int j) volatile { slot[j] = INVALID; }
+  TaggedBucket *next_bucket() volatile {
+    return reinterpret_cast<TaggedBucket *>(get_bucket_addr(next));
+  }
+  TaggedBucket *next_prefetched() volatile {
+    auto b = next_bucket();
+    if (b) _mm_prefetch(reinterpret_cast<const char *>(b), _MM_HINT_T0);
+    return b;
+  }
 } ALIGNED(CACHE_LINE_SIZE);
+static_assert(sizeof(TaggedBucket) == CACHE_LINE_SIZE &&
+                  MAX_PAGE_NUM * PAGE_SIZE <= TaggedBucket::OFFSET_MASK,
+              "a tagged slot holds any log offset");
+
+using Bucket = std::conditional_t<TAGGED_BUCKET, TaggedBucket, WideBucket>;
+static_assert(Bucket::SLOTS == ENTRIES_PER_BUCKET);
+#ifdef DRAM_INDEX
+static_assert(!TAGGED_BUCKET, "tagged entries are verified against PM");
+#endif
 
 struct Segment {
   union {
@@ -284,8 +887,10 @@ struct Segment {
       Bucket *buckets;
       size_t hash;
       size_t snapshot_version;
+      // one flag per CHECKPOINT_CHUNK buckets changed since the checkpoint
+      volatile uint8_t *dirty;
       uint8_t next_cache_line[CACHE_LINE_SIZE - (3 * sizeof(size_t)) -
-                              (sizeof(void *))];
+                              (2 * sizeof(void *))];
       DRAM_MemoryManager *hallocD;
       Segment *table_prev;
       Segment *table_new;
@@ -294,9 +899,12 @@ struct Segment {
         volatile uint32_t num_expands_threshold;
         uint32_t num_buckets_prev;
       };
-      volatile int32_t is_helper;
-      volatile int32_t helper_done;
+      // next bucket to migrate and number of migrated buckets
+      volatile size_t resize_next;
+      volatile size_t resize_done;
       size_t version_min;
+      // buckets not loaded from the snapshot yet after a lazy restart
+      LazyRegion *lazy;
     };
     uint8_t padding[2 * CACHE_LINE_SIZE];
   };
@@ -306,13 +914,19 @@ struct CLHT {
   union {
     struct {
       Segment *table;
-      uint8_t next_cache_line[CACHE_LINE_SIZE - (sizeof(void *))];
+      // verifies tagged entries against the records
+      record_hkey_t record_hkey;
+      uint8_t next_cache_line[CACHE_LINE_SIZE - (2 * sizeof(void *))];
       Segment *table_resizing;
       size_t resize_location;
       int64_t ID;
       volatile clht_lock_t resize_lock;
       volatile clht_lock_t gc_lock;
       volatile clht_lock_t status_lock;
+      // entries removed, checked for a shrink periodically
+      volatile size_t num_removes;
+      // the table is not shrunk below the size it was created for
+      size_t min_buckets;
     };
     uint8_t padding[2 * CACHE_LINE_SIZE];
   };
@@ -331,24 +945,55 @@ struct CLHT {
     _mm_sfence();
     *lock = 0;
   }
-  int LOCK_ACQ(clht_lock_t *lock, Segment *h) {
-    char once = 1;
+  static inline int LOCK_ACQ(clht_lock_t *lock) {
     clht_lock_t l;
     while ((l = __sync_val_compare_and_swap(lock, LOCK_STATE::LOCK_FREE,
                                             LOCK_STATE::LOCK_UPDATE)) ==
            LOCK_STATE::LOCK_UPDATE) {
-      if (once) once = 0;
       _mm_pause();
     }
-    if (l == LOCK_STATE::LOCK_RESIZE) {
-      while (h->table_new == NULL) {
-        _mm_pause();
-        _mm_mfence();
-      }
+    if (l != LOCK_STATE::LOCK_FREE) {
+      // the bucket is being migrated, its entries move to the new table
+      while (*lock != LOCK_STATE::LOCK_MIGRATED) _mm_pause();
       return 0;
     }
     return 1;
   }
+  /* The head bucket of a bin, loaded first after a lazy restart. */
+  static volatile Bucket *clht_bucket(Segment *hashtable, size_t bin) {
+    volatile Bucket *bucket = hashtable->buckets + bin;
+    lazy_touch(hashtable->lazy, bucket);
+    return bucket;
+  }
+  /* Lock the bucket of a key in the table that currently owns it. */
+  clht_lock_t *clht_lock_bucket(size_t key, Segment *&hashtable,
+                                volatile Bucket *&bucket) {
+    hashtable = table;
+    while (true) {
+      auto bin = clht_hash(hashtable, key);
+      bucket = clht_bucket(hashtable, bin);
+      if (LOCK_ACQ(&bucket->lock)) {
+        // the chain goes to the next checkpoint
+        auto &d = hashtable->dirty[bin / CHECKPOINT_CHUNK];
+        if (!d) d = 1;
+        return &bucket->lock;
+      }
+      // help the resize, then retry in the new table
+      ht_resize_help(hashtable);
+      hashtable = hashtable->table_new;
+    }
+  }
+  /* The bucket of a key for lock-free readers. */
+  volatile Bucket *clht_read_bucket(size_t key) {
+    Segment *hashtable = table;
+    volatile Bucket *bucket = clht_bucket(hashtable, clht_hash(hashtable, key));
+    // until a resize completes, migrated buckets are read from the new table
+    while (Unlikely(bucket->lock == LOCK_STATE::LOCK_MIGRATED)) {
+      hashtable = hashtable->table_new;
+      bucket = clht_bucket(hashtable, clht_hash(hashtable, key));
+    }
+    return bucket;
+  }
   // Swap size_t
   static inline size_t swap_uint64(volatile size_t *target, size_t x) {
     __asm__ __volatile__("xchgq %0,%1"
@@ -363,85 +1008,73 @@ struct CLHT {
                                             LOCK_STATE::LOCK_RESIZE)) ==
            LOCK_STATE::LOCK_UPDATE)
       _mm_pause();
-    if (l == LOCK_STATE::LOCK_RESIZE) return 0;
-    return 1;
+    return l == LOCK_FREE;
   }
   uint32_t clht_put_seq(Segment *hashtable, size_t key, clht_val_t val,
                         size_t bin) {
-    volatile Bucket *bucket = hashtable->buckets + bin;
-    uint32_t j;
+    volatile Bucket *bucket = clht_bucket(hashtable, bin);
+    // writers of already migrated buckets use the new table concurrently
+    clht_lock_t *lock = &bucket->lock;
+    LOCK_ACQ(lock);
 
     do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == INVALID) {
-          bucket->val[j] = val;
-          bucket->key[j] = key;
-          return true;
-        }
+      auto j = bucket->find_empty();
+      if (j >= 0) {
+        bucket->set(j, key, val);
+        LOCK_RLS(lock);
+        return true;
       }
 
       if (bucket->next == INVALID) {
         int null;
-        auto r = clht_bucket_create_stats(hashtable, &null);
-        auto b = r.second;
-        bucket->next = r.first;
-        b->val[0] = val;
-        b->key[0] = key;
+        auto b = clht_bucket_create_stats(hashtable, &null);
+        b->set(0, key, val);
+        bucket->next = reinterpret_cast<size_t>(b);
+        LOCK_RLS(lock);
         return true;
       }
 
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      bucket = bucket->next_bucket();
     } while (true);
   }
-  CLHT(size_t num_buckets, int id, size_t version, bool ini) {
+  CLHT(size_t num_buckets, int id, size_t version, bool ini,
+       record_hkey_t hkey) {
     ID = id;
+    record_hkey = hkey;
     table = clht_hashtable_create(num_buckets, version, ini);
     resize_location = UINT64_MAX;
     resize_lock = LOCK_FREE;
     gc_lock = LOCK_FREE;
     status_lock = LOCK_FREE;
+    num_removes = 0;
+    min_buckets = CLHT_MIN_BUCKETS;
   }
   /* Insert a key-value entry into a hash table. */
   int clht_put(size_t key, clht_val_t val) {
-    Segment *hashtable = table;
-    size_t bin = clht_hash(hashtable, key);
-    volatile Bucket *bucket = hashtable->buckets + bin;
-
-    clht_lock_t *lock = &bucket->lock;
-    while (!LOCK_ACQ(lock, hashtable)) {
-      hashtable = table;
-      size_t bin = clht_hash(hashtable, key);
+    Segment *hashtable;
+    volatile Bucket *bucket;
+    clht_lock_t *lock = clht_lock_bucket(key, hashtable, bucket);
 
-      bucket = hashtable->buckets + bin;
-      lock = &bucket->lock;
-    }
-
-    size_t *empty = NULL;
-    clht_val_t *empty_v = NULL;
+    volatile Bucket *empty = NULL;
+    int empty_j = 0;
 
-    uint32_t j;
     do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == key) {
-          LOCK_RLS(lock);
-          return false;
-        } else if (empty == NULL && bucket->key[j] == INVALID) {
-          empty = (size_t *)&bucket->key[j];
-          empty_v = &bucket->val[j];
-        }
+      auto next = bucket->next_prefetched();
+      if (bucket->find(key, record_hkey) >= 0) {
+        LOCK_RLS(lock);
+        return false;
       }
+      if (empty == NULL && (empty_j = bucket->find_empty()) >= 0)
+        empty = bucket;
 
       int resize = 0;
-      if (Likely(bucket->next == INVALID)) {
+      if (Likely(next == NULL)) {
         if (Unlikely(empty == NULL)) {
-          auto r = clht_bucket_create_stats(hashtable, &resize);
-          Bucket *b = r.second;
-          b->val[0] = val;
-          b->key[0] = key;
-          bucket->next = r.first;
+          auto b = clht_bucket_create_stats(hashtable, &resize);
+          b->set(0, key, val);
+          bucket->next = reinterpret_cast<size_t>(b);
         } else {
-          *empty_v = val;
-          *empty = key;
+          empty->set(empty_j, key, val);
         }
 
         LOCK_RLS(lock);
@@ -450,105 +1083,69 @@ struct CLHT {
         }
         return true;
       }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      bucket = next;
     } while (true);
   }
-  /* Remove a key-value entry from a hash table. */
+  /**
+   * @brief Remove a key-value entry from a hash table. The record is marked
+   * DELETED before the bucket lock is taken, the lock only covers dropping the
+   * entry, retried if the entry was replaced meanwhile.
+   *
+   * @return the freed bytes of the PPage and its id, {0, 0} if the key does
+   * not exist.
+   */
   template <typename KEY, typename VALUE>
   pair<size_t, size_t> clht_remove(size_t key, Pair_t<KEY, VALUE> *Null) {
-    Segment *hashtable = table;
-    size_t bin = clht_hash(hashtable, key);
-    volatile Bucket *bucket = hashtable->buckets + bin;
-
-    clht_lock_t *lock = &bucket->lock;
-    while (!LOCK_ACQ(lock, hashtable)) {
-      hashtable = table;
-      size_t bin = clht_hash(hashtable, key);
-
-      bucket = hashtable->buckets + bin;
-      lock = &bucket->lock;
-    }
-    uint32_t j;
-    do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == key) {
-          size_t sz = 0;
-          auto key = bucket->key[j];
-          auto poffset = bucket->val[j];
-          bucket->key[j] = INVALID;
-          bucket->val[j] = INVALID;
 #ifdef DRAM_INDEX
-          LOCK_RLS(lock);
-          return {0, 0};
-#endif
-          auto page_id = poffset / PAGE_SIZE;
-          auto addr = reinterpret_cast<char *>(PPage_table[page_id].load() +
-                                               poffset % PAGE_SIZE);
-          auto freed =
-              &reinterpret_cast<PAGE_METADATA *>(PPage_table[page_id].load())
-                   ->FREED;
-          auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(addr);
-          sz = __sync_fetch_and_add(freed, p->size());
-          sz += p->size();
-          pmem_persist(freed, 8);
-          p->set_op_persist(OP_t::DELETED);
-          LOCK_RLS(lock);
-          return {sz, page_id};
-        }
-      }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
-    } while (Unlikely(bucket != 0));
-    LOCK_RLS(lock);
+    clht_remove(key);
     return {0, 0};
+#endif
+    while (true) {
+      auto poffset = clht_get(key).first;
+      if (poffset == INVALID) return {0, 0};
+      auto page_id = poffset / PAGE_SIZE;
+      auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(
+          PPage_table[page_id].load() + poffset % PAGE_SIZE);
+      p->set_op_persist(OP_t::DELETED);
+      auto removed = clht_swap(key, poffset, INVALID);
+      if (Likely(removed == 1))
+        return {free_space.add(page_id, p->size()), page_id};
+      if (removed == 0) return {0, 0};
+    }
   }
   void clht_remove(size_t key) {
-    Segment *hashtable = table;
-    size_t bin = clht_hash(hashtable, key);
-    volatile Bucket *bucket = hashtable->buckets + bin;
-
-    clht_lock_t *lock = &bucket->lock;
-    while (!LOCK_ACQ(lock, hashtable)) {
-      hashtable = table;
-      size_t bin = clht_hash(hashtable, key);
-
-      bucket = hashtable->buckets + bin;
-      lock = &bucket->lock;
-    }
-    uint32_t j;
+    Segment *hashtable;
+    volatile Bucket *bucket;
+    clht_lock_t *lock = clht_lock_bucket(key, hashtable, bucket);
     do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == key) {
-          bucket->key[j] = INVALID;
-          bucket->val[j] = INVALID;
-          LOCK_RLS(lock);
-          return;
-        }
+      auto next = bucket->next_prefetched();
+      auto j = bucket->find(key, record_hkey);
+      if (j >= 0) {
+        bucket->clear(j);
+        LOCK_RLS(lock);
+        clht_removed(hashtable);
+        return;
       }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      bucket = next;
     } while (Unlikely(bucket != 0));
     LOCK_RLS(lock);
     return;
   }
+  /* Prefetch the head bucket of a key, used to overlap batched probes. */
+  void clht_prefetch(size_t key) {
+    Segment *hashtable = table;
+    _mm_prefetch(reinterpret_cast<const char *>(hashtable->buckets +
+                                                clht_hash(hashtable, key)),
+                 _MM_HINT_T0);
+  }
   /* Retrieve a key-value entry from a hash table. */
   pair<clht_val_t, uint8_t> clht_get(size_t key) {
-    size_t bin = clht_hash(table, key);
-    if (resize_lock)
-      ;
-    volatile Bucket *bucket = table->buckets + bin;
-    // auto bbb = bucket;
-    uint32_t j;
+    volatile Bucket *bucket = clht_read_bucket(key);
     do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        clht_val_t val = bucket->val[j];
-        if (bucket->key[j] == key) {
-          if (Likely(bucket->val[j] == val)) {
-            return {val, 0};
-          } else {
-            return {INVALID, 0};
-          }
-        }
-      }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      auto next = bucket->next_prefetched();
+      size_t val;
+      if (bucket->find(key, record_hkey, &val) >= 0) return {val, 0};
+      bucket = next;
     } while (Unlikely(bucket != NULL));
     return {INVALID, 0};
   }
@@ -557,206 +1154,341 @@ struct CLHT {
   template<class KEY,class VALUE>
   bool clht_get(size_t key, Pair_t<KEY, VALUE> *p)
   {
-    size_t bin = clht_hash(table, key);
-    if (resize_lock) ;
-    volatile Bucket *bucket = table->buckets + bin;
-    uint32_t j;
+    volatile Bucket *bucket = clht_read_bucket(key);
     do
     {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++)
+      auto next = bucket->next_prefetched();
+      size_t val;
+      if (bucket->find(key, record_hkey, &val) >= 0)
       {
-        clht_val_t val = bucket->val[j];
-        if (bucket->key[j] == key)
+        if (Likely(val != INVALID))
         {
-          if (Likely(bucket->val[j] == val))
-          {
 #ifdef DRAM_INDEX
-            return true;
+          return true;
 #else
-            auto page_index = val / PAGE_SIZE;
-            auto v = reinterpret_cast<Pair_t<KEY, VALUE> *>(PPage_table[page_index].load() +
-                                                            val % PAGE_SIZE);
-            if (v->str_key() == p->str_key())
-            {
-              p->load((char *)v);
-              return true;
-            }
-#endif
+          auto page_index = val / PAGE_SIZE;
+          auto v = reinterpret_cast<Pair_t<KEY, VALUE> *>(PPage_table[page_index].load() +
+                                                          val % PAGE_SIZE);
+          if (v->str_key() == p->str_key() && v->get_op() != OP_t::DELETED)
+          {
+            p->load((char *)v);
+            return true;
           }
+#endif
         }
       }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      bucket = next;
     } while (Unlikely(bucket != NULL));
     return false;
   }
   /* Insert a key-value pair into a hashtable with replacement. */
   template <typename KEY, typename VALUE>
-  pair<int, size_t> clht_put_replace(size_t key, Pair_t<KEY, VALUE> *p) {
-    Segment *hashtable = table;
-    size_t bin = clht_hash(hashtable, key);
-    volatile Bucket *bucket = hashtable->buckets + bin;
-    clht_lock_t *lock = &bucket->lock;
-
-    while (!LOCK_ACQ(lock, hashtable)) {
-      hashtable = table;
-      size_t bin = clht_hash(hashtable, key);
-
-      bucket = hashtable->buckets + bin;
-      lock = &bucket->lock;
+  pair<int, size_t> clht_put_replace(size_t key, Pair_t<KEY, VALUE> *p,
+                                     bool revive = false) {
+    return clht_put_replace<KEY, VALUE>(
+        key, p->size(),
+        [p](char *addr, OP_VERSION old_version) {
+          p->set_version(old_version);
+          // an UPDATE until the swap commits, p stays an INSERT
+          p->set_op(OP_t::UPDATE);
+          p->store_persist(addr);
+          p->set_op(OP_t::INSERT);
+        },
+        revive);
+  }
+  /**
+   * @brief Replace the record of a key with a new record of len bytes, written
+   * by store(addr, version) as an UPDATE and persisted before the bucket lock
+   * is taken. Under the lock the new record turns INSERT and then the old one
+   * UPDATE, so a replace that loses to a concurrent update or delete never
+   * leaves an INSERT behind for recovery. If the entry changed meanwhile, the
+   * new record is discarded and the replace is retried.
+   *
+   * @param revive replace a tombstone instead of a live record, its space was
+   * freed when it was written.
+   * @return the freed bytes of the old PPage and the old offset, {0, 0} if
+   * there is no record to replace.
+   */
+  template <typename KEY, typename VALUE, typename STORE>
+  pair<int, size_t> clht_put_replace(size_t key, size_t len, STORE &&store,
+                                     bool revive = false) {
+    while (true) {
+      auto old_offset = clht_get(key).first;
+      if (old_offset == INVALID) return {0, 0};
+      auto old = reinterpret_cast<Pair_t<KEY, VALUE> *>(
+          PPage_table[old_offset / PAGE_SIZE].load() + old_offset % PAGE_SIZE);
+      if ((old->get_op() == OP_t::DELETED) != revive) return {0, 0};
+      auto o_a = mmanager.halloc(len);
+      auto version = old->version;
+      store(reinterpret_cast<char *>(o_a.second), version);
+      mmanager.update_metadata();
+      auto record = reinterpret_cast<Pair_t<KEY, VALUE> *>(o_a.second);
+      auto commit = [&]() {
+        // an in place update since the record was stored
+        if (old->version != version) return false;
+        // the new record is durable first, so one of the two stays INSERT
+        record->set_op_persist(OP_t::INSERT);
+        old->set_op_persist(OP_t::UPDATE);
+        return true;
+      };
+      auto swapped = clht_swap(key, old_offset, o_a.first, commit);
+      if (Likely(swapped == 1))
+        return {revive ? 1 : free_space.add(old_offset / PAGE_SIZE, old->size()),
+                old_offset};
+      // lost to a concurrent update or delete, the new record stays UPDATE
+      free_space.add(o_a.first / PAGE_SIZE, len);
+      if (swapped == 0) return {0, 0};
     }
-
-    size_t *empty = NULL;
-    clht_val_t *empty_v = NULL;
-
-    uint32_t j;
-    do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == key) {
-          empty = (size_t *)&bucket->key[j];
-          empty_v = &bucket->val[j];
-          break;
+  }
+  /**
+   * @brief Point the entry of a key from offset_old to offset_new, the only
+   * step of an update or delete done under the bucket lock.
+   *
+   * An offset_old of INVALID inserts the key if it does not exist. An
+   * overflow bucket emptied at the tail of its chain is unlinked and reused,
+   * removed entries may shrink the table.
+   *
+   * @param commit run under the lock before the entry is swapped, returns
+   * false to keep the entry.
+   * @return 1 if swapped, 0 if the key does not exist, -1 if the entry no
+   * longer points to offset_old or commit returned false.
+   */
+  template <typename COMMIT = std::nullptr_t>
+  int clht_swap(size_t key, clht_val_t offset_old, clht_val_t offset_new,
+                COMMIT &&commit = nullptr) {
+    Segment *hashtable;
+    volatile Bucket *bucket;
+    clht_lock_t *lock = clht_lock_bucket(key, hashtable, bucket);
+    volatile Bucket *empty = NULL, *prev = NULL;
+    int empty_j = 0;
+    while (true) {
+      auto next = bucket->next_prefetched();
+      auto j = bucket->find(key, record_hkey);
+      if (j >= 0) {
+        int r = -1;
+        if (bucket->value(j) == offset_old && swap_commit(commit)) {
+          if (offset_new != INVALID) {
+            bucket->set_value(j, offset_new);
+          } else {
+            bucket->clear(j);
+            if (prev && next == NULL && bucket->is_empty()) {
+              prev->next = INVALID;
+              __sync_sub_and_fetch(&hashtable->num_expands, 1);
+              hashtable->hallocD->free_bucket((char *)bucket);
+            }
+          }
+          r = 1;
         }
+        LOCK_RLS(lock);
+        if (r == 1 && offset_new == INVALID) clht_removed(hashtable);
+        return r;
       }
-
-      int r = 0;
-      size_t old_offset = 0;
-      if (Likely(bucket->next == INVALID)) {
-        if (Unlikely(empty == NULL)) {
-          LOCK_RLS(lock);
-          return {0, 0};
-        } else {
-          old_offset = *empty_v;
-          auto old = reinterpret_cast<Pair_t<KEY, VALUE> *>(
-              PPage_table[old_offset / PAGE_SIZE].load() +
-              old_offset % PAGE_SIZE);
-          p->set_version(old->version);
-          auto o_a = mmanager.halloc(p->size());
-          p->store_persist(o_a.second);
-          // add persist
-          old->set_op_persist(OP_t::UPDATE);
-          auto f = &reinterpret_cast<PAGE_METADATA *>(
-                        PPage_table[old_offset / PAGE_SIZE].load())
-                        ->FREED;
-          r = __sync_fetch_and_add(f, old->size()) + old->size();
-          // add persist
-          pmem_persist(f, 8);
-          *empty_v = o_a.first;
-          LOCK_RLS(lock);
-          return {r, old_offset};
-        }
+      if (empty == NULL && offset_old == INVALID &&
+          (empty_j = bucket->find_empty()) >= 0)
+        empty = bucket;
+      if (next == NULL) break;
+      prev = bucket;
+      bucket = next;
+    }
+    if (offset_old != INVALID || offset_new == INVALID) {
+      LOCK_RLS(lock);
+      return 0;
+    }
+    if (!swap_commit(commit)) {
+      LOCK_RLS(lock);
+      return -1;
+    }
+    int resize = 0;
+    if (Unlikely(empty == NULL)) {
+      auto b = clht_bucket_create_stats(hashtable, &resize);
+      b->set(0, key, offset_new);
+      bucket->next = reinterpret_cast<size_t>(b);
+    } else {
+      empty->set(empty_j, key, offset_new);
+    }
+    LOCK_RLS(lock);
+    if (Unlikely(resize)) ht_status(1, 0);
+    return 1;
+  }
+  /* Run the commit hook of clht_swap, if it was given one. */
+  template <typename COMMIT>
+  static bool swap_commit(COMMIT &commit) {
+    if constexpr (std::is_null_pointer_v<std::decay_t<COMMIT>>)
+      return true;
+    else
+      return commit();
+  }
+  /**
+   * @brief Update the value of the record of a key in place, under the bucket
+   * lock so the cleaner does not move the record meanwhile. No record is
+   * written, so no space is freed.
+   *
+   * @return 1 if updated, 0 if the key does not exist, -1 if the record is
+   * not aligned for an atomic update or is being replaced.
+   */
+  template <typename KEY, typename VALUE>
+  int clht_update_inplace(size_t key, VALUE v) {
+    Segment *hashtable;
+    volatile Bucket *bucket;
+    clht_lock_t *lock = clht_lock_bucket(key, hashtable, bucket);
+    do {
+      auto next = bucket->next_prefetched();
+      auto j = bucket->find(key, record_hkey);
+      if (j >= 0) {
+        auto offset = bucket->value(j);
+        auto addr = reinterpret_cast<char *>(
+            PPage_table[offset / PAGE_SIZE].load() + offset % PAGE_SIZE);
+        // a record marked UPDATE is being replaced, the write would be lost
+        auto op = reinterpret_cast<Pair_t<KEY, VALUE> *>(addr)->get_op();
+        auto r = op == OP_t::DELETED ? 0 : -1;
+        if (op == OP_t::INSERT && Pair_t<KEY, VALUE>::update_value(addr, v))
+          r = 1;
+        LOCK_RLS(lock);
+        return r;
       }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
-    } while (true);
+      bucket = next;
+    } while (bucket != NULL);
+    LOCK_RLS(lock);
+    return 0;
   }
-  /* update during recovery */
+  /* Insert during recovery, the record with the larger version wins. */
   template <typename KEY, typename VALUE>
-  void clht_put_replace(size_t key, size_t poffset, Pair_t<KEY, VALUE> *Null) {
-    Segment *hashtable = table;
-    size_t bin = clht_hash(hashtable, key);
-    volatile Bucket *bucket = hashtable->buckets + bin;
-    clht_lock_t *lock = &bucket->lock;
-
-    while (!LOCK_ACQ(lock, hashtable)) {
-      hashtable = table;
-      size_t bin = clht_hash(hashtable, key);
-
-      bucket = hashtable->buckets + bin;
-      lock = &bucket->lock;
-    }
+  void clht_put_recover(size_t key, size_t poffset, Pair_t<KEY, VALUE> *p) {
+    Segment *hashtable;
+    volatile Bucket *bucket;
+    clht_lock_t *lock = clht_lock_bucket(key, hashtable, bucket);
 
-    size_t *empty = NULL;
-    clht_val_t *empty_v = NULL;
+    volatile Bucket *empty = NULL;
+    int empty_j = 0;
 
-    uint32_t j;
     do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == key) {
-          empty = (size_t *)&bucket->key[j];
-          empty_v = &bucket->val[j];
-          break;
-        }
+      auto j = bucket->find(key, record_hkey);
+      if (j >= 0) {
+        size_t old_offset = bucket->value(j);
+        auto page = old_offset == INVALID
+                        ? INVALID
+                        : PPage_table[old_offset / PAGE_SIZE].load();
+        auto old = reinterpret_cast<Pair_t<KEY, VALUE> *>(
+            page + old_offset % PAGE_SIZE);
+        // the snapshot may point to a cleaned PPage or a stale record, or
+        // hold a half removed entry
+        if (page == INVALID || !indexed_op(old->get_op()) ||
+            old->version < p->version)
+          bucket->set_value(j, poffset);
+        LOCK_RLS(lock);
+        return;
       }
+      if (empty == NULL && (empty_j = bucket->find_empty()) >= 0)
+        empty = bucket;
 
-      int r = 0;
-      size_t old_offset = 0;
+      int resize = 0;
       if (Likely(bucket->next == INVALID)) {
         if (Unlikely(empty == NULL)) {
-          LOCK_RLS(lock);
-          return;
+          auto b = clht_bucket_create_stats(hashtable, &resize);
+          b->set(0, key, poffset);
+          bucket->next = reinterpret_cast<size_t>(b);
         } else {
-          old_offset = *empty_v;
-          auto old = reinterpret_cast<Pair_t<KEY, VALUE> *>(
-              PPage_table[old_offset / PAGE_SIZE].load() +
-              old_offset % PAGE_SIZE);
-          auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(
-              PPage_table[poffset / PAGE_SIZE].load() + poffset % PAGE_SIZE);
-          if (p->version > old->version) {
-            if (old->op != OP_t::DELETED && old->op != OP_t::TRASH) {
-              auto f = &reinterpret_cast<PAGE_METADATA *>(
-                            PPage_table[old_offset / PAGE_SIZE].load())
-                            ->FREED;
-              __sync_fetch_and_add(f, old->size());
-            }
-            *empty_v = poffset;
-          }
-          LOCK_RLS(lock);
-          return;
+          empty->set(empty_j, key, poffset);
         }
+
+        LOCK_RLS(lock);
+        if (Unlikely(resize)) {
+          ht_status(1, 0);
+        }
+        return;
       }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      bucket = bucket->next_bucket();
     } while (true);
   }
   template <typename KEY, typename VALUE>
   int clht_put_move(size_t key, PM_MemoryManager &mmanager,
                     Pair_t<KEY, VALUE> *p, size_t offset_old,
                     size_t *reclaimed) {
-    Segment *hashtable = table;
-    size_t bin = clht_hash(hashtable, key);
-    volatile Bucket *bucket = hashtable->buckets + bin;
+    Segment *hashtable;
+    volatile Bucket *bucket;
+    clht_lock_t *lock = clht_lock_bucket(key, hashtable, bucket);
 
-    clht_lock_t *lock = &bucket->lock;
-    while (!LOCK_ACQ(lock, hashtable)) {
-      hashtable = table;
-      size_t bin = clht_hash(hashtable, key);
-
-      bucket = hashtable->buckets + bin;
-      lock = &bucket->lock;
-    }
-
-    size_t *empty = NULL;
-    clht_val_t *empty_v = NULL;
+    volatile Bucket *empty = NULL;
+    int empty_j = 0;
 
-    uint32_t j;
     do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == key) {
-          empty = (size_t *)&bucket->key[j];
-          empty_v = &bucket->val[j];
-          break;
-        }
-      }
+      if (empty == NULL && (empty_j = bucket->find(key, record_hkey)) >= 0)
+        empty = bucket;
       int resize = 0;
       if (Likely(bucket->next == INVALID)) {
         if (Unlikely(empty == NULL)) {
           assert(empty == NULL);
         } else {
-          if (*empty_v == offset_old) {
+          if (empty->value(empty_j) == offset_old) {
             auto r = mmanager.halloc(p->size());
             p->store_persist(r.second);
-            *empty_v = r.first;
+            // an indexed record is live even if an update marked it already
+            if (Unlikely(p->get_op() == OP_t::UPDATE))
+              reinterpret_cast<Pair_t<KEY, VALUE> *>(r.second)
+                  ->set_op_persist(OP_t::INSERT);
+            // a tombstone is freed as soon as it is written
+            if (p->get_op() == OP_t::DELETED)
+              free_space.add(r.first / PAGE_SIZE, p->size());
+            empty->set_value(empty_j, r.first);
             mmanager.update_metadata();
             _mm_stream_si64(reinterpret_cast<long long *>(reclaimed),
                             *reinterpret_cast<long long *>(&offset_old));
             pmem_drain();
+            LOCK_RLS(lock);
+            return true;
           }
         }
         LOCK_RLS(lock);
-        return true;
+        return false;
       }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      bucket = bucket->next_bucket();
     } while (true);
   }
   
+  /* Check for a shrink each time as many entries as a table at
+   * CLHT_PERC_FULL_HALVE holds were removed. */
+  void clht_removed(Segment *hashtable) {
+    auto period = std::max<size_t>(hashtable->num_buckets * ENTRIES_PER_BUCKET *
+                                       CLHT_PERC_FULL_HALVE / 100,
+                                   1);
+    auto removes = __sync_add_and_fetch(&num_removes, 1);
+    if (removes % period == 0) ht_shrink_check(removes);
+  }
+  /**
+   * @brief Estimate the load of the table from CLHT_SHRINK_SAMPLE bins, so a
+   * delete does not scan the whole table. A table below CLHT_PERC_FULL_HALVE
+   * is shrunk. A table whose chains use a small part of the DPages they were
+   * carved from is rebuilt at the same size, which gives the rest back.
+   *
+   * @param seed picks the first sampled bin.
+   */
+  void ht_shrink_check(size_t seed) {
+    if (resize_lock || TRYLOCK_ACQ(&status_lock)) return;
+    Segment *hashtable = table;
+    auto num_buckets = hashtable->num_buckets;
+    auto sample = std::min(num_buckets, CLHT_SHRINK_SAMPLE);
+    auto first = seed * 0x9e3779b97f4a7c15ULL;
+    size_t size = 0, expands = 0;
+    for (size_t i = 0; i < sample; i++) {
+      volatile Bucket *bucket =
+          clht_bucket(hashtable, (first + i) & hashtable->hash);
+      for (;; expands++) {
+        for (int j = 0; j < ENTRIES_PER_BUCKET; j++) size += bucket->used(j);
+        bucket = bucket->next_bucket();
+        if (bucket == NULL) break;
+      }
+    }
+    double full_ratio = 100.0 * size / (sample * ENTRIES_PER_BUCKET);
+    // bytes of the overflow buckets in use
+    auto overflow = expands * (num_buckets / sample) * sizeof(Bucket);
+    auto carved = hashtable->hallocD->allocated();
+    if (full_ratio < CLHT_PERC_FULL_HALVE && num_buckets > min_buckets) {
+      ht_resize_pes(0, 0);
+    } else if (carved > PAGE_SIZE && overflow * CLHT_RATIO_HALVE < carved) {
+      ht_resize_pes(1, 1);
+    }
+    TRYLOCK_RLS(status_lock);
+  }
   int ht_resize_pes(int is_increase, int by) {
     Segment *ht_old = table;
 
@@ -768,44 +1500,68 @@ struct CLHT {
     if (is_increase == true) {
       num_buckets_new = by * ht_old->num_buckets;
     } else {
-      num_buckets_new = ht_old->num_buckets / CLHT_RATIO_HALVE;
+      num_buckets_new =
+          std::max(ht_old->num_buckets / CLHT_RATIO_HALVE, min_buckets);
     }
     // printf("from %f to %f.\n", 1.0 * ht_old->num_buckets / 1024 / 1024,
     //        1.0 * num_buckets_new / 1024 / 1024);
     Segment *ht_new =
         clht_hashtable_create(num_buckets_new, ht_old->snapshot_version + 1);
+    ht_new->table_prev = ht_old;
+    // publish the new table before any bucket is migrated, from now on every
+    // thread that runs into a migrated bucket helps with the migration.
+    ht_old->table_new = ht_new;
+    _mm_mfence();
     // auto checkpoint = nphase();
-    int32_t b;
-    for (b = 0; b < ht_old->num_buckets; b++) {
-      Bucket *bu_cur = ht_old->buckets + b;
-      bucket_cpy(bu_cur, ht_new);
+    while (ht_resize_help(ht_old))
+      ;
+    return 1;
+  }
+
+  /* Migrate the next chunk of buckets, return 0 if none is left. */
+  int ht_resize_help(Segment *ht_old) {
+    size_t start = __sync_fetch_and_add(&ht_old->resize_next, RESIZE_CHUNK_SIZE);
+    if (start >= ht_old->num_buckets) return 0;
+    size_t end = std::min(start + RESIZE_CHUNK_SIZE, ht_old->num_buckets);
+    for (size_t b = start; b < end; b++) {
+      bucket_cpy(clht_bucket(ht_old, b), ht_old->table_new);
     }
-    ht_new->table_prev = ht_old;
+    if (__sync_add_and_fetch(&ht_old->resize_done, end - start) ==
+        ht_old->num_buckets) {
+      ht_resize_finish(ht_old);
+    }
+    return 1;
+  }
 
+  /* Called by the thread that migrated the last chunk. */
+  void ht_resize_finish(Segment *ht_old) {
+    Segment *ht_new = ht_old->table_new;
     swap_uint64((size_t *)&table, (size_t)ht_new);
-    ht_old->table_new = ht_new;
-    // ht_new->hallocD->persist(ht_new, checkpoint);
     ht_old->hallocD->reclaim(ht_old);
     TRYLOCK_RLS(resize_lock);
-    return 1;
+    // the new table may have hit its threshold during the migration
+    if (ht_new->num_expands >= ht_new->num_expands_threshold) ht_status(1, 0);
   }
 
   int bucket_cpy(volatile Bucket *bucket, Segment *ht_new) {
     if (!LOCK_ACQ_RES(&bucket->lock)) {
       return 0;
     }
+    volatile Bucket *head = bucket;
     uint32_t j;
     do {
       for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        size_t key = bucket->key[j];
-        if (key != INVALID) {
+        if (bucket->used(j)) {
+          size_t key = bucket->hkey(j, record_hkey);
           size_t bin = clht_hash(ht_new, key);
-          clht_put_seq(ht_new, key, bucket->val[j], bin);
+          clht_put_seq(ht_new, key, bucket->value(j), bin);
         }
       }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      bucket = bucket->next_bucket();
     } while (bucket != NULL);
-
+    // readers and writers of this bucket switch to the new table
+    _mm_sfence();
+    head->lock = LOCK_STATE::LOCK_MIGRATED;
     return 1;
   }
   size_t clht_size(Segment *hashtable) {
@@ -815,23 +1571,25 @@ struct CLHT {
 
     size_t bin;
     for (bin = 0; bin < num_buckets; bin++) {
-      bucket = hashtable->buckets + bin;
+      bucket = clht_bucket(hashtable, bin);
 
       uint32_t j;
       do {
         for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-          if (bucket->key[j] > 0) {
+          if (bucket->used(j)) {
             size++;
           }
         }
 
-        bucket = (Bucket *)get_DPage_addr(bucket->next);
+        bucket = bucket->next_bucket();
       } while (bucket != NULL);
     }
     return size;
   }
 
   size_t ht_status(int resize_increase, int just_print) {
+    // a resize is already running
+    if (!just_print && resize_lock) return 0;
     if (TRYLOCK_ACQ(&status_lock) && !resize_increase) {
       return 0;
     }
@@ -845,7 +1603,7 @@ struct CLHT {
 
     size_t bin;
     for (bin = 0; bin < num_buckets; bin++) {
-      bucket = hashtable->buckets + bin;
+      bucket = clht_bucket(hashtable, bin);
 
       int expands_cont = -1;
       expands--;
@@ -854,12 +1612,12 @@ struct CLHT {
         expands_cont++;
         expands++;
         for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-          if (bucket->key[j] > 0) {
+          if (bucket->used(j)) {
             size++;
           }
         }
 
-        bucket = (Bucket *)get_DPage_addr(bucket->next);
+        bucket = bucket->next_bucket();
       } while (bucket != NULL);
 
       if (expands_cont > expands_max) {
@@ -909,14 +1667,13 @@ struct CLHT {
 
   static inline int is_odd(int x) { return x & 1; }
 
-  pair<size_t, Bucket *> clht_bucket_create_stats(Segment *h, int *resize) {
-    auto r = h->hallocD->halloc(sizeof(Bucket));
-    Bucket *bucket = (Bucket *)r.second;
+  Bucket *clht_bucket_create_stats(Segment *h, int *resize) {
+    Bucket *bucket = (Bucket *)h->hallocD->alloc_bucket();
     bucket->lock = 0;
 
     uint32_t j;
     for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-      bucket->key[j] = INVALID;
+      bucket->clear(j);
     }
     bucket->next = INVALID;
 
@@ -925,7 +1682,7 @@ struct CLHT {
        * h->num_expands_threshold); */
       *resize = 1;
     }
-    return {r.first, reinterpret_cast<Bucket *>(r.second)};
+    return bucket;
   }
 
   Segment *clht_hashtable_create(size_t num_buckets, size_t version,
@@ -959,7 +1716,7 @@ struct CLHT {
         hashtable->buckets[i].next = INVALID;
         uint32_t j;
         for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-          hashtable->buckets[i].key[j] = INVALID;
+          hashtable->buckets[i].clear(j);
         }
       }
 
@@ -969,13 +1726,16 @@ struct CLHT {
     hashtable->hallocD = new DRAM_MemoryManager(ID, version);
     hashtable->table_new = NULL;
     hashtable->table_prev = NULL;
+    hashtable->lazy = NULL;
+    hashtable->dirty = static_cast<volatile uint8_t *>(
+        calloc((num_buckets + CHECKPOINT_CHUNK - 1) / CHECKPOINT_CHUNK, 1));
     hashtable->num_expands = 0;
     hashtable->num_expands_threshold = (CLHT_PERC_EXPANSIONS * num_buckets);
     if (hashtable->num_expands_threshold == 0) {
       hashtable->num_expands_threshold = 1;
     }
-    hashtable->is_helper = 1;
-    hashtable->helper_done = 0;
+    hashtable->resize_next = 0;
+    hashtable->resize_done = 0;
 
     return hashtable;
   }
@@ -991,15 +1751,11 @@ struct CLHT {
     return key & (hashtable->hash);
   }
 
-  static inline int bucket_exists(volatile Bucket *bucket, size_t key) {
-    uint32_t j;
+  inline int bucket_exists(volatile Bucket *bucket, size_t key) {
     do {
-      for (j = 0; j < ENTRIES_PER_BUCKET; j++) {
-        if (bucket->key[j] == key) {
-          return true;
-        }
-      }
-      bucket = (Bucket *)get_DPage_addr(bucket->next);
+      auto next = bucket->next_prefetched();
+      if (bucket->find(key, record_hkey) >= 0) return true;
+      bucket = next;
     } while (Unlikely(bucket != NULL));
     return false;
   }
@@ -1013,7 +1769,12 @@ struct CLHT {
 template <typename KEY, typename VALUE>
 class Halo {
  public:
-  Halo(size_t N) {
+  /* The buckets of each sub-table created for N pairs. */
+  static size_t initial_buckets(size_t N) {
+    size_t sz = log2(N / TABLE_NUM / ENTRIES_PER_BUCKET);
+    return pow(2, sz);
+  }
+  Halo(size_t N, const LogCleanerOptions &gc = LogCleanerOptions()) {
     cout << typeid(KEY).name() << " " << typeid(VALUE).name() << endl;
     memset(clhts, 0, TABLE_NUM * sizeof(void *));
 
@@ -1022,50 +1783,10 @@ class Halo {
       t.start();
 
       // Recover memory manager
-      auto checkpoints = memory_manager_Pool.startup(clhts);
+      auto checkpoints = memory_manager_Pool.startup(clhts, &Halo::hkey_at);
 
       // Redo log entries if there was a system crash
-      auto redo_log = [](size_t start_page_id, int aid,
-                         CLHT *clhts[TABLE_NUM]) {
-        for (size_t i = start_page_id; i < MAX_PAGE_NUM; i++) {
-          auto addr = PPage_table[i].load();
-          if (addr == INVALID) continue;
-          auto id = reinterpret_cast<PAGE_METADATA *>(addr)->ALLOCATOR_ID;
-          if (aid == id) {
-            auto current = addr + PRESERVE_SIZE_EACH_PAGE;
-            auto poffset = aid * PAGE_SIZE + PRESERVE_SIZE_EACH_PAGE;
-            auto end =
-                addr + reinterpret_cast<PAGE_METADATA *>(addr)->LOCAL_OFFSET;
-            while (current < end) {
-              auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(current);
-              if (p->get_op() == OP_t::INSERT) {
-                auto hkey =
-                    hash_func(reinterpret_cast<void *>(p->key()), p->klen());
-                auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
-                clhts[n]->clht_put(hkey, poffset);
-              } else if (p->get_op() == OP_t::UPDATE) {
-                if constexpr (sizeof(KEY) > 8 || sizeof(VALUE) > 8) {
-                  auto hkey =
-                      hash_func(reinterpret_cast<void *>(p->key()), p->klen());
-                  auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
-                  clhts[n]->clht_put_replace(hkey, poffset, p);
-                }
-              } else if (p->get_op() == OP_t::DELETED) {
-                auto hkey =
-                    hash_func(reinterpret_cast<void *>(p->key()), p->klen());
-                auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
-                clhts[n]->clht_remove(hkey);
-              }
-            }
-          }
-        }
-      };
-      if (!ROOT->clean) {
-        std::vector<thread> ts;
-        for (size_t i = 0; i < CORE_NUM; i++)
-          ts.push_back(std::thread(redo_log, checkpoints[i], i, clhts));
-        for (auto &&i : ts) i.join();
-      }
+      if (!ROOT->clean) redo_log(checkpoints);
       // print();
       std::cout << "Recover cost " << t.elapsed<std::chrono::milliseconds>()
                 << " ms." << endl;
@@ -1074,28 +1795,61 @@ class Halo {
     } else {
       memory_manager_Pool.creat();
       cout << "Create new table." << endl;
-      auto sz = N / TABLE_NUM;
-      cout << sz << " ";
-      sz = log2(sz / ENTRIES_PER_BUCKET);
-      cout << sz << " ";
-      sz = pow(2, sz);
+      auto sz = initial_buckets(N);
       for (size_t i = 0; i < TABLE_NUM; i++) ROOT->SS[i].SEGMENT_SIZE = sz;
       pmem_persist(ROOT->SS, sizeof(ROOT->SS) * TABLE_NUM);
       cout << sz * TABLE_NUM * ENTRIES_PER_BUCKET << endl;
       for (size_t i = 0; i < TABLE_NUM; i++) {
-        clhts[i] = new CLHT(sz, i, 0, true);
+        clhts[i] = new CLHT(sz, i, 0, true, &Halo::hkey_at);
       }
     }
+    for (size_t i = 0; i < TABLE_NUM; i++)
+      clhts[i]->min_buckets = std::max(initial_buckets(N), CLHT_MIN_BUCKETS);
     load_factor();
+    if (LOGCLEAN)
+      cleaner.start(gc, [this](size_t page_id, PM_MemoryManager &cold,
+                               PM_MemoryManager &hot) {
+        clean_ppage(page_id, cold, hot);
+      });
+    if (SNAPSHOT && CHECKPOINT)
+      checkpointer.start(CHECKPOINT_INTERVAL, CHECKPOINT_RATE_LIMIT,
+                         [this]() { checkpoint(); });
+    if (WRITE_BATCHING)
+      flusher.start(BATCH_FLUSH_BOUND, [this](WriteBatch &b) {
+        flush_batch(b);
+        // flushed by the bound: less load, batch less
+        b.threshold = std::max(b.threshold / 2, MIN_BATCHING_SIZE);
+      });
   }
 
   ~Halo() {
-    for (auto &&i : reclaim_threads) i.join();
+    flusher.stop();
+    checkpointer.stop();
+    cleaner.stop();
+    epoch_manager.drain();
+    if (LOGCLEAN)
+      printf("log cleaning, pages freed: %lu, bytes moved: %lu (hot: %lu)\n",
+             cleaner.pages_freed.load(), cleaner.bytes_moved.load(),
+             cleaner.hot_bytes_moved.load());
+    if (CHECKPOINT)
+      printf("checkpoints: %lu, bytes written: %lu\n",
+             checkpointer.checkpoints.load(),
+             checkpointer.bytes_written.load());
+    if (GROUP_COMMIT)
+      printf("group commit: %lu records in %lu batches\n",
+             group_commit.records.load(), group_commit.batches.load());
+    if (WRITE_BATCHING)
+      printf("write batching: %lu timed flushes\n",
+             flusher.timed_flushes.load());
+    free_space.persist();
     memory_manager_Pool.shutdown(clhts);
     printf("count: %lu, count1: %lu, count2: %lu, count3: %lu, total_count: %lu\n",
            halo_count.load(), halo_count1.load(), halo_count2.load(), halo_count3.load(),
            halo_count.load() + halo_count1.load() + halo_count2.load() + halo_count3.load());
     printf("extra_write_count: %lu\n", halo_write_count.load());
+    if (XPLINE_LOG && xpline_count.load())
+      printf("XPLine log: %.1f bytes per XPLine\n",
+             xpline_bytes.load() * 1.0 / xpline_count.load());
   }
 
   bool Insert(Pair_t<KEY, VALUE> &p, int *r) {
@@ -1113,6 +1867,7 @@ class Halo {
     }
     if (Unlikely(mmanager.ID == -1))
       memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    EpochGuard guard;
 
     {
       // test: test pm allocator insert performance
@@ -1130,66 +1885,122 @@ class Halo {
 
     auto hkey = hash_func(reinterpret_cast<void *>(p.key()), p.klen());
     auto addr = get_PM_addr(hkey);
+    p.set_op(INSERT);
+    // replace a tombstone, again if it is replaced or dropped meanwhile
+    for (; is_tombstone(addr); addr = get_PM_addr(hkey)) {
+      auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+      if (clhts[n]->clht_put_replace(hkey, &p, true).first) {
+        if (r) *r = DONE;
+        return true;
+      }
+    }
+    if (WRITE_BATCHING)
+      return insert_batch(hkey, addr != nullptr, p.size(), r,
+                          [&p](char *addr) { p.store(addr); });
     if (addr == nullptr) {
-      auto len = p.size();
-      auto &pm = mmanager;
-      auto offset_and_addr = pm.halloc(len);
-      auto offset = offset_and_addr.first;
-      auto addr = offset_and_addr.second;
-      auto add = reinterpret_cast<long long *>(&p);
-      auto paddr = reinterpret_cast<long long *>(addr);
-      pmem_memcpy_persist(paddr, add, len);
-      pm.update_metadata();
+      // serialize, string keys and values are not stored inline in p
+      auto offset = append_record(p.size(), [&p](char *addr) { p.store(addr); });
       // halo_write_count.fetch_add(2);
       auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
       clhts[n]->clht_put(hkey, offset);
-      return true;
-    }
-    else {
-      return true;
     }
-    // check if the key exists
-    // auto addr = get_PM_addr(hkey);
-    if (addr != nullptr) {
-      *r = EXIST;
-      WRITE_PASS_COUNT++;
-      if (WRITE_PASS_COUNT + WRITE_BUFFER_COUNTER > MAX_PAIR) {
-        do_insert_now(nullptr);
+    return true;
+  }
+
+  /**
+   * @brief Insert a record serialized straight from the key and value bytes
+   * into PM, without building a Pair_t.
+   *
+   * @param k the key bytes, a KEY object for fixed-size keys.
+   * @param klen length of the key.
+   * @param v the value bytes, a VALUE object for fixed-size values.
+   * @param vlen length of the value.
+   * @param r set to EXIST if the key exists, like Insert(Pair_t) it still
+   * returns true then.
+   */
+  bool Insert(const void *k, size_t klen, const void *v, size_t vlen,
+              int *r = nullptr) {
+    if (Unlikely(mmanager.ID == -1))
+      memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    EpochGuard guard;
+    auto hkey = hash_func(k, klen);
+    auto addr = get_PM_addr(hkey);
+    auto len = Pair_t<KEY, VALUE>::encoded_size(klen, vlen);
+    for (; is_tombstone(addr); addr = get_PM_addr(hkey)) {
+      auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+      auto sz = clhts[n]->template clht_put_replace<KEY, VALUE>(
+          hkey, len,
+          [&](char *addr, OP_VERSION old_version) {
+            Pair_t<KEY, VALUE>::encode(
+                addr, RECORD_HEADER(OP_t::UPDATE, old_version + 1), k, klen, v,
+                vlen);
+            pmem_persist(addr, len);
+          },
+          true);
+      if (sz.first) {
+        if (r) *r = DONE;
         return true;
       }
-      return false;
-    } else {
-      p.set_op(INSERT);
-      INSERT_RESULT_POINTER[WRITE_BUFFER_COUNTER++] = r;
-      auto sz = p.size();
-      auto tsz = WRITE_BUFFER_SIZE + sz;
-      auto threashold = MAX_BATCHING_SIZE;
-      if (tsz >= MAX_BATCHING_SIZE && tsz <= MAX_WRITE_BUFFER_SIZE ||
-          tsz < MAX_BATCHING_SIZE) {
-        p.store(WRITE_BUFFER + WRITE_BUFFER_SIZE);
-        WRITE_BUFFER_SIZE = tsz;
-        if (tsz < threashold) return false;
-      }
-      void *ptr = nullptr;
-      // current pair is a big pair that does not need to batch
-      if (tsz > MAX_WRITE_BUFFER_SIZE) ptr = &p;
-      // if ptr is not nullptr, the ptr point to a big pair.
-      do_insert_now(ptr);
+    }
+    auto exists = addr != nullptr;
+    auto fill = [&](char *addr) {
+      Pair_t<KEY, VALUE>::encode(addr, RECORD_HEADER(OP_t::INSERT, 0), k, klen,
+                                 v, vlen);
+    };
+    if (WRITE_BATCHING) return insert_batch(hkey, exists, len, r, fill);
+    if (exists) {
+      if (r) *r = EXIST;
       return true;
     }
+    auto offset = append_record(len, fill);
+    clhts[GET_CLHT_INDEX(hkey, TABLE_NUM)]->clht_put(hkey, offset);
+    return true;
+  }
+
+  /* Update from the key and value bytes, see Insert(k, klen, v, vlen). */
+  bool Update(const void *k, size_t klen, const void *v, size_t vlen,
+              int *r = nullptr) {
+    if (Unlikely(mmanager.ID == -1))
+      memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    EpochGuard guard;
+    auto hkey = hash_func(k, klen);
+    auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+    if constexpr (INPLACE_PAIR<KEY, VALUE>) {
+      VALUE value;
+      memcpy(&value, v, sizeof(VALUE));
+      auto done = clhts[n]->clht_update_inplace<KEY, VALUE>(hkey, value);
+      if (done >= 0) return done;
+    }
+    auto len = Pair_t<KEY, VALUE>::encoded_size(klen, vlen);
+    auto sz = clhts[n]->clht_put_replace<KEY, VALUE>(
+        hkey, len, [&](char *addr, OP_VERSION old_version) {
+          Pair_t<KEY, VALUE>::encode(
+              addr, RECORD_HEADER(OP_t::UPDATE, old_version + 1), k, klen, v,
+              vlen);
+          pmem_persist(addr, len);
+        });
+    if (!sz.first) return false;
+    reclaim_ppage(sz.second / PAGE_SIZE, sz.first);
+    return true;
   }
 
   bool Update(Pair_t<KEY, VALUE> &p, int *r) {
     if (Unlikely(mmanager.ID == -1))
       memory_manager_Pool.get_PM_MemoryManager(&mmanager);
-    p.set_op(OP_t::UPDATE);
+    // the latest record of a key is INSERT, superseded ones are UPDATE.
+    p.set_op(OP_t::INSERT);
+    EpochGuard guard;
     auto hkey = hash_func(reinterpret_cast<void *>(p.key()), p.klen());
     auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+    if constexpr (INPLACE_PAIR<KEY, VALUE>) {
+      auto done = clhts[n]->template clht_update_inplace<KEY, VALUE>(hkey, p.value());
+      if (done >= 0) return done;
+    }
     auto sz = clhts[n]->clht_put_replace(hkey, &p);
-    READ_LOCK();
     if (!sz.first) {
       return false;
     }
+    reclaim_ppage(sz.second / PAGE_SIZE, sz.first);
     return true;
   }
 
@@ -1206,37 +2017,242 @@ class Halo {
     {
 #ifdef NO_READ_BUFFER
       // test: no read buffer performance
+      EpochGuard guard;
       auto hkey = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
       auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
-      auto r = clhts[n]->clht_get(hkey, p);
-      READ_LOCK();
-      return r;
+      return clhts[n]->clht_get(hkey, p);
 #endif
       }
 
       if (Unlikely(READ_BUFFER_SIZE == 1))
       {
+        EpochGuard guard;
         auto hkey = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
         auto addr = get_PM_addr(hkey);
-        if (addr)
+        if (addr && !is_tombstone(addr))
         {
           p->load(addr);
         }
-        READ_LOCK();
         return true;
       }
       BUFFER_READ[BUFFER_READ_COUNTER++] = p;
       if (BUFFER_READ_COUNTER == READ_BUFFER_SIZE)
       {
         Gets();
-        READ_LOCK();
         return true;
       }
-      READ_LOCK();
       return false;
     }
     void get_all() { Gets(); }
-    bool Delete(Pair_t<KEY, VALUE> &p)
+  /**
+   * @brief Look up a key without copying the record out of PM.
+   *
+   * @param key the key bytes, a KEY object for fixed-size keys.
+   * @param klen length of the key.
+   * @return a view of the record, empty if the key is not found.
+   */
+  PairView GetView(const void *key, size_t klen) {
+    epoch_manager.enter();
+    auto hkey = hash_func(key, klen);
+    auto addr = get_PM_addr(hkey);
+    if (addr &&
+        reinterpret_cast<Pair_t<KEY, VALUE> *>(addr)->get_op() !=
+            OP_t::DELETED) {
+      auto k = Pair_t<KEY, VALUE>::key_view(addr);
+      if (k == std::string_view(static_cast<const char *>(key), klen))
+        return PairView(k, Pair_t<KEY, VALUE>::value_view(addr));
+    }
+    epoch_manager.exit();
+    return PairView();
+  }
+  /**
+   * @brief Look up a batch of pairs. Every key of a chunk is hashed and its
+   * head bucket prefetched, then all buckets are probed and the PM records
+   * prefetched, and only then the records are copied out, so the DRAM and PM
+   * misses of up to MULTIGET_BATCH_SIZE keys overlap.
+   *
+   * @param ps pairs with the keys set, the values are loaded on hit.
+   * @param n number of pairs.
+   * @param found per-key status, true if the key was found.
+   * @return number of keys found.
+   */
+  size_t MultiGet(Pair_t<KEY, VALUE> **ps, size_t n, bool *found) {
+    size_t hkeys[MULTIGET_BATCH_SIZE];
+    char *addrs[MULTIGET_BATCH_SIZE];
+    size_t hit = 0;
+    EpochGuard guard;
+    for (size_t base = 0; base < n; base += MULTIGET_BATCH_SIZE) {
+      auto cnt = std::min(MULTIGET_BATCH_SIZE, n - base);
+      // hash and prefetch the head buckets
+      for (size_t i = 0; i < cnt; i++) {
+        auto p = ps[base + i];
+        hkeys[i] = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
+        clhts[GET_CLHT_INDEX(hkeys[i], TABLE_NUM)]->clht_prefetch(hkeys[i]);
+      }
+      // probe and prefetch the PM records
+      for (size_t i = 0; i < cnt; i++) {
+        addrs[i] = get_PM_addr(hkeys[i]);
+        if (addrs[i]) _mm_prefetch(addrs[i], _MM_HINT_T0);
+      }
+      // load
+      for (size_t i = 0; i < cnt; i++) {
+        auto r = ps[base + i];
+        auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(addrs[i]);
+        found[base + i] =
+            p && p->get_op() != OP_t::DELETED &&
+            Pair_t<KEY, VALUE>::key_view(addrs[i]) ==
+                std::string_view(reinterpret_cast<const char *>(r->key()),
+                                 r->klen());
+        if (found[base + i]) {
+          r->load(addrs[i]);
+          hit++;
+        }
+      }
+    }
+    return hit;
+  }
+  /**
+   * @brief Insert or update a batch of pairs. A chunk of keys is grouped by
+   * sub-table and probed with the buckets prefetched, its records are
+   * persisted as one append and the replaced records invalidated under one
+   * fence, and only then the entries are swapped. A key whose entry changed
+   * meanwhile is put again by Upsert.
+   *
+   * @param ps the pairs.
+   * @param n number of pairs.
+   * @param results per-key result, DONE.
+   * @return number of pairs put.
+   */
+  size_t MultiPut(Pair_t<KEY, VALUE> **ps, size_t n, int *results) {
+    if (Unlikely(mmanager.ID == -1))
+      memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    // the writes still buffered by this thread go first
+    do_insert_now();
+    size_t hkeys[MULTIGET_BATCH_SIZE], olds[MULTIGET_BATCH_SIZE];
+    size_t order[MULTIGET_BATCH_SIZE], offsets[MULTIGET_BATCH_SIZE];
+    EpochGuard guard;
+    for (size_t base = 0; base < n; base += MULTIGET_BATCH_SIZE) {
+      auto cnt = std::min(MULTIGET_BATCH_SIZE, n - base);
+      auto chunk = ps + base;
+      multi_probe(chunk, cnt, hkeys, olds, order);
+      size_t total = 0;
+      for (size_t i = 0; i < cnt; i++) {
+        auto p = chunk[i];
+        auto old = pair_at(olds[i]);
+        p->set_op(OP_t::INSERT);
+        if (old) p->set_version(old->version);
+        else p->version = 0;
+        offsets[i] = total;
+        total += p->size();
+      }
+      auto offset = append_record(total, [&](char *addr) {
+        for (size_t i = 0; i < cnt; i++) chunk[i]->store(addr + offsets[i]);
+      });
+      for (size_t i = 0; i < cnt; i++) {
+        offsets[i] += offset;
+        auto old = pair_at(olds[i]);
+        if (old && old->get_op() != OP_t::DELETED)
+          old->set_op_flush(OP_t::UPDATE);
+      }
+      pmem_drain();
+      for (size_t j = 0; j < cnt; j++) {
+        auto i = order[j];
+        auto t = GET_CLHT_INDEX(hkeys[i], TABLE_NUM);
+        if (Likely(clhts[t]->clht_swap(hkeys[i], olds[i], offsets[i]) == 1)) {
+          // tombstones are freed when written
+          auto old = pair_at(olds[i]);
+          if (old && !is_tombstone(reinterpret_cast<char *>(old)))
+            reclaim_ppage(olds[i] / PAGE_SIZE,
+                          free_space.add(olds[i] / PAGE_SIZE, old->size()));
+        } else {
+          discard_record(offsets[i], chunk[i]->size());
+          Upsert(*chunk[i]);
+        }
+        results[base + i] = DONE;
+      }
+    }
+    return n;
+  }
+  /**
+   * @brief Delete a batch of keys, probed like MultiPut. The records are
+   * marked DELETED under one fence, or with TOMBSTONE_DELETE their
+   * tombstones persisted as one append, then the entries are dropped. A key
+   * whose entry changed meanwhile is deleted again by Delete.
+   *
+   * @param ps pairs with the keys set.
+   * @param n number of pairs.
+   * @param results per-key result, DONE or NOT_FOUND.
+   * @return number of keys deleted.
+   */
+  size_t MultiDelete(Pair_t<KEY, VALUE> **ps, size_t n, int *results) {
+    if (Unlikely(mmanager.ID == -1))
+      memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    do_insert_now();
+    size_t hkeys[MULTIGET_BATCH_SIZE], olds[MULTIGET_BATCH_SIZE];
+    size_t order[MULTIGET_BATCH_SIZE], offsets[MULTIGET_BATCH_SIZE];
+    auto len = [](Pair_t<KEY, VALUE> *p) {
+      return Pair_t<KEY, VALUE>::encoded_size(p->klen(), TOMBSTONE_VLEN<VALUE>);
+    };
+    size_t deleted = 0;
+    EpochGuard guard;
+    for (size_t base = 0; base < n; base += MULTIGET_BATCH_SIZE) {
+      auto cnt = std::min(MULTIGET_BATCH_SIZE, n - base);
+      auto chunk = ps + base;
+      multi_probe(chunk, cnt, hkeys, olds, order);
+      size_t total = 0;
+      for (size_t i = 0; i < cnt; i++) {
+        auto old = pair_at(olds[i]);
+        // a tombstone or a record being deleted is a missing key
+        if (old && old->get_op() == OP_t::DELETED) olds[i] = INVALID;
+        if (olds[i] == INVALID) continue;
+        offsets[i] = total;
+        if (TOMBSTONE_DELETE) total += len(chunk[i]);
+        else old->set_op_flush(OP_t::DELETED);
+      }
+      if (TOMBSTONE_DELETE && total) {
+        auto offset = append_record(total, [&](char *addr) {
+          for (size_t i = 0; i < cnt; i++) {
+            if (olds[i] == INVALID) continue;
+            char target[TOMBSTONE_VLEN<VALUE>] = {};
+            uint32_t page = olds[i] / PAGE_SIZE;
+            memcpy(target, &page, sizeof(page));
+            Pair_t<KEY, VALUE>::encode(
+                addr + offsets[i],
+                RECORD_HEADER(OP_t::DELETED, pair_at(olds[i])->version + 1),
+                chunk[i]->key(), chunk[i]->klen(), target, sizeof(target));
+          }
+        });
+        for (size_t i = 0; i < cnt; i++) offsets[i] += offset;
+      } else {
+        pmem_drain();
+      }
+      for (size_t j = 0; j < cnt; j++) {
+        auto i = order[j];
+        auto p = chunk[i];
+        bool done = false;
+        if (olds[i] == INVALID) {
+          results[base + i] = NOT_FOUND;
+          continue;
+        }
+        if (TOMBSTONE_DELETE) {
+          done = index_tombstone(hkeys[i], olds[i], offsets[i], len(p)) ||
+                 delete_tombstone(hkeys[i], p->key(), p->klen(), nullptr, false);
+        } else {
+          auto t = GET_CLHT_INDEX(hkeys[i], TABLE_NUM);
+          auto r = clhts[t]->clht_swap(hkeys[i], olds[i], INVALID);
+          if (r == 1)
+            reclaim_ppage(olds[i] / PAGE_SIZE,
+                          free_space.add(olds[i] / PAGE_SIZE,
+                                         pair_at(olds[i])->size()));
+          done = r == 1 || (r == -1 && Delete(*p));
+        }
+        results[base + i] = done ? DONE : NOT_FOUND;
+        deleted += done;
+      }
+    }
+    return deleted;
+  }
+    bool Delete(Pair_t<KEY, VALUE> &p, int *r = nullptr)
     {
       {
 #ifdef DRAM_INDEX
@@ -1246,18 +2262,93 @@ class Halo {
       return true;
 #endif
     }
+    EpochGuard guard;
     auto hkey = hash_func(reinterpret_cast<void *>(p.key()), p.klen());
     auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
     auto offset = clhts[n]->clht_get(hkey).first;
     if (offset == INVALID) return false;
     if (Unlikely(mmanager.ID == -1))
       memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    if (TOMBSTONE_DELETE) return delete_tombstone(hkey, p.key(), p.klen(), r);
     auto sz = clhts[n]->clht_remove(hkey, &p);
     if (!sz.first) return false;
     reclaim_ppage(sz.second, sz.first);
-    READ_LOCK();
     return true;
   }
+  /**
+   * @brief Read-modify-write a key with one index probe and one bucket lock.
+   * f(current, p) sets the value of p from current, a copy of the latest
+   * record or nullptr if the key does not exist, and returns false to leave
+   * the key as it is. The new record is appended marked UPDATE, which replay
+   * ignores. Under the lock it is persisted as INSERT before the old record is
+   * marked UPDATE, so a crash leaves one of the two live. If the entry or the
+   * version of the old record changed meanwhile, the new record stays
+   * UPDATE and f runs again on the newer pair.
+   *
+   * @param p the key, and the value set by f.
+   * @return false if f returned false.
+   */
+  template <typename F>
+  bool ReadModifyWrite(Pair_t<KEY, VALUE> &p, F &&f) {
+    if (Unlikely(mmanager.ID == -1))
+      memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    // f sees the writes still buffered by this thread
+    do_insert_now();
+    EpochGuard guard;
+    auto hkey = hash_func(reinterpret_cast<void *>(p.key()), p.klen());
+    auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+    while (true) {
+      auto old_offset = clhts[n]->clht_get(hkey).first;
+      Pair_t<KEY, VALUE> *old = nullptr, current;
+      if (old_offset != INVALID)
+        old = reinterpret_cast<Pair_t<KEY, VALUE> *>(
+            PPage_table[old_offset / PAGE_SIZE].load() +
+            old_offset % PAGE_SIZE);
+      // a tombstone or a record being deleted is a missing key
+      bool live = old && old->get_op() != OP_t::DELETED;
+      if (live) current.load(reinterpret_cast<char *>(old));
+      if (!f(live ? &current : nullptr, p)) return false;
+      p.set_op(OP_t::UPDATE);
+      if (old) p.set_version(old->version);
+      else p.version = 0;
+      auto len = p.size();
+      auto offset = append_record(len, [&p](char *addr) { p.store(addr); });
+      auto record = pair_at(offset);
+      auto commit = [&]() {
+        // an in place update since current was read
+        if (live && old->version != current.version) return false;
+        record->set_op_persist(OP_t::INSERT);
+        if (live) old->set_op_persist(OP_t::UPDATE);
+        return true;
+      };
+      // tombstones are freed when written
+      bool reclaim = old && !is_tombstone(reinterpret_cast<char *>(old));
+      if (Likely(clhts[n]->clht_swap(hkey, old_offset, offset, commit) == 1)) {
+        if (reclaim)
+          reclaim_ppage(old_offset / PAGE_SIZE,
+                        free_space.add(old_offset / PAGE_SIZE, old->size()));
+        return true;
+      }
+      free_space.add(offset / PAGE_SIZE, len);
+    }
+  }
+  /* Insert a pair, or update it if the key exists, see ReadModifyWrite. */
+  bool Upsert(Pair_t<KEY, VALUE> &p, int *r = nullptr) {
+    ReadModifyWrite(p, [](Pair_t<KEY, VALUE> *, Pair_t<KEY, VALUE> &) {
+      return true;
+    });
+    if (r) *r = DONE;
+    return true;
+  }
+  /* Update a key to desired if its value is expected's, see ReadModifyWrite. */
+  bool CompareAndSwap(Pair_t<KEY, VALUE> &expected,
+                      Pair_t<KEY, VALUE> &desired) {
+    return ReadModifyWrite(
+        desired, [&expected](Pair_t<KEY, VALUE> *current,
+                             Pair_t<KEY, VALUE> &) {
+          return current && current->value() == expected.value();
+        });
+  }
   void load_factor() {
     // size_t total_slot = 0;
     // size_t used_slot = 0;
@@ -1297,11 +2388,12 @@ class Halo {
       for (size_t j = 0; j < t->num_buckets; j++)
       {
         auto b = t->buckets + j;
-        b = (Bucket *)get_DPage_addr(b->next);
+        lazy_touch(t->lazy, b);
+        b = b->next_bucket();
         while (b)
         {
           total_dram += sizeof(Bucket);
-          b = (Bucket *)get_DPage_addr(b->next);
+          b = b->next_bucket();
         }
       }
     }
@@ -1310,95 +2402,192 @@ class Halo {
   }
 
   void wait_all() { do_insert_now(); }
+  /* Checkpoint all sub-tables, the redo log then starts at `nphase()`. */
+  void checkpoint() {
+    // the snapshot being loaded is still the latest one
+    if (LAZY_LOADING.load()) return;
+    std::lock_guard<std::mutex> lock(checkpoint_mtx);
+    // records written before are covered by the checkpoint, the rest is
+    // redone, so buckets may change while they are written.
+    auto checkpoints = nphase();
+    _mm_mfence();
+    for (size_t i = 0; i < TABLE_NUM; i++) {
+      EpochGuard guard;
+      auto seg = clhts[i]->table;
+      // entries are being migrated, checkpoint the new table next time
+      if (seg->table_new) continue;
+      seg->hallocD->checkpoint(seg, checkpoints, checkpointer);
+    }
+    free_space.persist();
+  }
   void reclaim_ppage(size_t page_id, size_t sz_freed) {
     if (!LOGCLEAN) return;
+    if (!cleaner.need_clean(sz_freed)) return;
+    if (memory_manager_Pool.is_in_allocating(page_id)) return;
+    cleaner.submit(page_id, sz_freed);
+  }
+
+ private:
+  /* Move the live records of a PPage to the cleaner's PPages and delete it. */
+  void clean_ppage(size_t page_id, PM_MemoryManager &cold,
+                   PM_MemoryManager &hot) {
+    auto base = reinterpret_cast<char *>(PPage_table[page_id].load());
+    auto metadata = reinterpret_cast<PAGE_METADATA *>(base);
+    auto addr = base + PRESERVE_SIZE_EACH_PAGE;
+    auto offset = page_id * PAGE_SIZE + PRESERVE_SIZE_EACH_PAGE;
+    auto end = base + metadata->LOCAL_OFFSET;
+    while (addr < end) {
+      auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(addr);
+      auto sz = record_size<KEY, VALUE>(addr);
+      if (p->get_op() != TRASH && p->get_op() != DELETED) {
+        EpochGuard guard;
+        auto hkey = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
+        auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+        // records that survived cleaning are cold unless updated frequently
+        bool is_hot = p->version >= HOT_VERSION_THRESHOLD;
+        if (clhts[n]->clht_put_move(hkey, is_hot ? hot : cold, p, offset,
+                                    &metadata->RECLAIMED))
+          cleaner.throttle(sz, is_hot);
+      } else if (TOMBSTONE_DELETE && p->get_op() == DELETED) {
+        // a tombstone is needed while the record it deletes may be replayed
+        EpochGuard guard;
+        auto hkey = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
+        auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+        auto target = tombstone_target<KEY, VALUE>(addr);
+        if (target != page_id && PPage_table[target].load() != INVALID) {
+          if (clhts[n]->clht_put_move(hkey, cold, p, offset,
+                                      &metadata->RECLAIMED))
+            cleaner.throttle(sz, false);
+        } else {
+          clhts[n]->clht_swap(hkey, offset, INVALID);
+        }
+      }
+      addr += sz;
+      offset += sz;
+    }
+    // readers may still hold offsets into the PPage, unmap it once they left.
+    epoch_manager.retire([page_id, base]() {
+      PPage_table[page_id].store(INVALID);
+      MemoryManager::delete_pm_file(page_id, base);
+    });
+  }
 
-    if (sz_freed * 100 / PAGE_SIZE < CLEAN_THRESHOLD) {
-      return;
+  /**
+   * @brief Replay the PPages written after the checkpoints. The PPages are
+   * collected in one pass over the PPage_table and replayed page by page by a
+   * pool of one worker per hardware thread. Only INSERT records are live,
+   * superseded and deleted records are marked UPDATE and DELETED in place.
+   * With TOMBSTONE_DELETE, a tombstone is indexed like a record and hides the
+   * records of its key with older versions.
+   *
+   * @param checkpoints the first PPage to replay of each allocator.
+   */
+  void redo_log(const std::vector<size_t> &checkpoints) {
+    Timer t;
+    t.start();
+    std::vector<size_t> pages;
+    for (size_t i = 0; i < PM_MemoryManager::PAGE_ID; i++) {
+      auto addr = PPage_table[i].load();
+      if (addr == INVALID) continue;
+      auto aid = reinterpret_cast<PAGE_METADATA *>(addr)->ALLOCATOR_ID;
+      if (aid < CORE_NUM && i >= checkpoints[aid]) pages.push_back(i);
     }
-    {
-      std::lock_guard<std::mutex> lock(reclaim_mtx);
-      if (ppages_reclaiming.count(page_id))
-        return;
-      else
-        ppages_reclaiming.insert(page_id);
-    }
-    if (memory_manager_Pool.is_in_allocating(page_id)) {
-      return;
-    }
-    std::lock_guard<std::mutex> lock(thread_mutex);
-    reclaim_threads.push_back(std::thread(
-        [](size_t page_id, CLHT *clhts[TABLE_NUM], mutex &RECLAIM_MTX,
-           mutex &reclaim_mtx, std::set<size_t> &ppages_reclaiming) {
-          memory_manager_Pool.get_PM_MemoryManager(&mmanager, false);
-          auto addr = PPage_table[page_id].load() + PRESERVE_SIZE_EACH_PAGE;
-          auto offset = page_id * PAGE_SIZE + PRESERVE_SIZE_EACH_PAGE;
-          auto end =
-              PPage_table[page_id].load() +
-              reinterpret_cast<PAGE_METADATA *>(PPage_table[page_id].load())
-                  ->LOCAL_OFFSET;
-          map<size_t, size_t> key_newoffset;
-          size_t *reclaimed =
-              &reinterpret_cast<PAGE_METADATA *>(addr)->RECLAIMED;
-          while (addr < end) {
-            auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(addr);
-            if (p->get_op() != TRASH) {
-              auto hkey =
-                  hash_func(reinterpret_cast<void *>(p->key()), p->klen());
-              auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
-              clhts[n]->clht_put_move(hkey, mmanager, p, offset, reclaimed);
+    std::cout << "Redo: " << pages.size() << " PPages to replay, scan cost "
+              << t.elapsed<std::chrono::milliseconds>() << " ms." << endl;
+    t.start();
+    atomic_size_t records(0);
+    parallel_for(pages.size(), [&](size_t i) {
+      EpochGuard guard;
+      auto page_id = pages[i];
+      auto addr = reinterpret_cast<char *>(PPage_table[page_id].load());
+      auto current = addr + PRESERVE_SIZE_EACH_PAGE;
+      auto poffset = page_id * PAGE_SIZE + PRESERVE_SIZE_EACH_PAGE;
+      auto end = addr + std::min(PAGE_SIZE, reinterpret_cast<PAGE_METADATA *>(
+                                                addr)->LOCAL_OFFSET);
+      size_t count = 0, freed = 0;
+      while (current < end) {
+        auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(current);
+        auto sz = record_size<KEY, VALUE>(current);
+        if (p->get_op() == OP_t::UPDATE || p->get_op() == OP_t::DELETED)
+          freed += sz;
+        if (indexed_op(p->get_op())) {
+          auto hkey = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
+          auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+          clhts[n]->clht_put_recover(hkey, poffset, p);
+          count++;
+        }
+        current += sz;
+        poffset += sz;
+      }
+      free_space.set(page_id, freed);
+      records += count;
+    });
+    std::cout << "Redo: " << records.load() << " records replayed, cost "
+              << t.elapsed<std::chrono::milliseconds>() << " ms." << endl;
+    // drop the entries restored from the snapshot whose record died later.
+    t.start();
+    atomic_size_t dropped(0);
+    parallel_for(TABLE_NUM, [&](size_t i) {
+      auto seg = clhts[i]->table;
+      for (size_t j = 0; j < seg->num_buckets; j++) {
+        auto b = seg->buckets + j;
+        for (; b; b = b->next_bucket()) {
+          for (size_t k = 0; k < ENTRIES_PER_BUCKET; k++) {
+            if (!b->used(k)) continue;
+            auto offset = b->value(k);
+            auto page = offset == INVALID
+                            ? INVALID
+                            : PPage_table[offset / PAGE_SIZE].load();
+            if (page == INVALID ||
+                !indexed_op(reinterpret_cast<Pair_t<KEY, VALUE> *>(
+                                page + offset % PAGE_SIZE)
+                                ->get_op())) {
+              b->clear(k);
+              dropped++;
             }
-            addr += p->size();
-            offset += p->size();
-          }
-          {
-            lock_guard<mutex> guard_reclaim(RECLAIM_MTX);
-            RECLAIM.store(true);
-            PPage_table[page_id].store(INVALID);
-            WAIT_READ_LOCK();
-            RECLAIM.store(false);
-            RELEASE_READ_LOCK();
-            mmanager.delete_pm_file(page_id);
-            cout << page_id << " reallocated." << endl;
           }
-          {
-            std::lock_guard<std::mutex> lock(reclaim_mtx);
-            ppages_reclaiming.erase(page_id);
-          }
-        },
-        page_id, clhts, std::ref(RECLAIM_MTX), std::ref(reclaim_mtx),
-        std::ref(ppages_reclaiming)));
+        }
+      }
+    });
+    std::cout << "Redo: " << dropped.load() << " dead entries dropped, cost "
+              << t.elapsed<std::chrono::milliseconds>() << " ms." << endl;
   }
 
- private:
   void Gets() {
-    // prefetch
-    char *addrs[READ_BUFFER_SIZE];
-    for (size_t i = 0; i < READ_BUFFER_SIZE; i++) {
-      auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(BUFFER_READ[i]);
-      auto hkey = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
-      addrs[i] = get_PM_addr(hkey);
-      if (addrs[i])
-        _mm_prefetch(reinterpret_cast<char *>(addrs[i]), _MM_HINT_NTA);
-      else
-        p->set_empty();
-    }
-    // load
-    for (size_t i = 0; i < READ_BUFFER_SIZE; i++) {
-      if (!addrs[i]) {
-        continue;
-      }
-      auto r = reinterpret_cast<Pair_t<KEY, VALUE> *>(BUFFER_READ[i]);
-      auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(addrs[i]);
-      // cout << r->str_key() << "!" << p->str_key() << " " << p->value() <<
-      // endl;
-      if (r->str_key() != p->str_key()) cout << "ERROR!" << endl;
-      r->load(addrs[i]);
-      if (r->get_op() == OP_t::DELETED) r->set_empty();
-    }
+    bool found[READ_BUFFER_SIZE];
+    auto ps = reinterpret_cast<Pair_t<KEY, VALUE> **>(BUFFER_READ);
+    MultiGet(ps, BUFFER_READ_COUNTER, found);
+    for (size_t i = 0; i < BUFFER_READ_COUNTER; i++)
+      if (!found[i]) ps[i]->set_empty();
     BUFFER_READ_COUNTER = 0;
   }
 
+  /* Persist a record of len bytes written by fill(addr), return its offset. */
+  template <typename FILL>
+  size_t append_record(size_t len, FILL &&fill) {
+    if (GROUP_COMMIT && len <= MAX_WRITE_BUFFER_SIZE) {
+      fill(WRITE_BUFFER);
+      return group_commit.commit(WRITE_BUFFER, len);
+    }
+    if (XPLINE_LOG) {
+      std::unique_ptr<char[]> big;
+      auto buf = WRITE_BUFFER;
+      if (len > MAX_WRITE_BUFFER_SIZE) {
+        big.reset(new char[len]);
+        buf = big.get();
+      }
+      fill(buf);
+      auto o_a = mmanager.append_xpline(buf, len);
+      pmem_drain();
+      mmanager.update_metadata();
+      return o_a.first;
+    }
+    auto o_a = mmanager.halloc(len);
+    fill(o_a.second);
+    pmem_persist(o_a.second, len);
+    mmanager.update_metadata();
+    return o_a.first;
+  }
   char *get_PM_addr(size_t hkey) {
     auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
     auto offset = clhts[n]->clht_get(hkey).first;
@@ -1407,62 +2596,217 @@ class Halo {
     return reinterpret_cast<char *>(PPage_table[page_index].load() +
                                     offset % PAGE_SIZE);
   }
-  void do_insert_now(void *ptr = nullptr) {
-    if (!WRITE_BUFFER_COUNTER) return;
-    auto len = WRITE_BUFFER_SIZE;
-    auto &pm = mmanager;
-    auto offset_and_addr = pm.halloc(len);
-    auto offset = offset_and_addr.first;
-    auto addr = offset_and_addr.second;
-    auto add = reinterpret_cast<long long *>(WRITE_BUFFER);
-    auto paddr = reinterpret_cast<long long *>(addr);
-    auto end = len / 8;
-    for (size_t i = 0; i < end; i++) {
-      _mm_stream_si64(paddr + i, add[i]);
-    }
-    auto bigoffset = 0ULL;
-    // write big pair to PM
-    if (ptr) {
-      auto bigpair = reinterpret_cast<Pair_t<KEY, VALUE> *>(ptr);
-      auto add = reinterpret_cast<long long *>(ptr);
-      auto o_and_a = pm.halloc(bigpair->size());
-      bigoffset = o_and_a.first;
-      auto paddr = reinterpret_cast<long long *>(o_and_a.second);
-      pmem_memcpy_persist(paddr, add, bigpair->size());
-    }
-    pmem_drain();
-    pm.update_metadata();
-    pmem_drain();
-    offset = offset_and_addr.first;
-    bool resizing_flag_local = false;
-    auto pair_addr = WRITE_BUFFER;
-    // remove the count of big pair. The big pair is handled later.
-    if (ptr) WRITE_BUFFER_COUNTER--;
-    // insert key and offset into hash table
-    for (size_t i = 0; i < WRITE_BUFFER_COUNTER; i++) {
-      auto p = Pair_t<KEY, VALUE>(pair_addr);
-      auto hkey = hash_func(reinterpret_cast<void *>(p.key()), p.klen());
-      auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
-      clhts[n]->clht_put(hkey, offset);
-      offset += p.size();
-      pair_addr += p.size();
+  void do_insert_now() {
+    if (!WRITE_BATCHING) return;
+    auto &b = flusher.local();
+    std::lock_guard<std::mutex> lock(b.mtx);
+    flush_batch(b);
+  }
+  /**
+   * @brief Buffer an insert in the write batch of the calling thread. The
+   * batch is flushed when it reaches its threshold, which then grows, or when
+   * its oldest insert is older than BATCH_FLUSH_BOUND, which shrinks it.
+   *
+   * @param exists the key is in the index, the insert is not buffered.
+   * @param len length of the record written by fill(addr).
+   * @param r set to DONE once the insert is durable, EXIST if the key exists.
+   * @return true if the insert is durable on return.
+   */
+  template <typename FILL>
+  bool insert_batch(size_t hkey, bool exists, size_t len, int *r,
+                    FILL &&fill) {
+    if (exists) {
+      if (r) *r = EXIST;
+      return true;
     }
-    // insert big pair into hash table.
-    if (ptr) {
-      auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(ptr);
-      auto hkey = hash_func(reinterpret_cast<void *>(p->key()), p->klen());
-      auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
-      clhts[n]->clht_put(hkey, bigoffset);
+    return batch_record(hkey, INVALID, len, r, fill);
+  }
+  /* Buffer a record, a tombstone if it replaces the entry old, see above. */
+  template <typename FILL>
+  bool batch_record(size_t hkey, size_t old, size_t len, int *r, FILL &&fill) {
+    auto &b = flusher.local();
+    std::lock_guard<std::mutex> lock(b.mtx);
+    if (flusher.expired(b)) {
+      flush_batch(b);
+      b.threshold = std::max(b.threshold / 2, MIN_BATCHING_SIZE);
+    }
+    // a big pair is not batched
+    if (len > MAX_WRITE_BUFFER_SIZE) {
+      flush_batch(b);
+      auto offset = append_record(len, fill);
+      bool put = clhts[GET_CLHT_INDEX(hkey, TABLE_NUM)]->clht_put(hkey, offset);
+      if (!put) discard_record(offset, len);
+      if (r) *r = put ? DONE : EXIST;
+      return true;
+    }
+    if (b.size + len > MAX_WRITE_BUFFER_SIZE) flush_batch(b);
+    fill(b.buffer + b.size);
+    b.olds[b.count] = old;
+    b.hkeys[b.count] = hkey;
+    b.lens[b.count] = len;
+    b.results[b.count++] = r;
+    b.size += len;
+    if (r) *r = INSERTING;
+    if (b.count == 1) b.since.store(BatchFlusher::now(), std::memory_order_relaxed);
+    if (b.size >= b.threshold || b.count == MAX_BUFFER_PAIR_SIZE) {
+      // filled within the bound: more load, batch more
+      if (b.size >= b.threshold)
+        b.threshold = std::min(b.threshold * 2, MAX_WRITE_BUFFER_SIZE);
+      flush_batch(b);
+      return true;
+    }
+    return false;
+  }
+  /* Write a batch to PM and index it, the caller holds its lock. */
+  void flush_batch(WriteBatch &b) {
+    if (!b.count) return;
+    if (Unlikely(mmanager.ID == -1))
+      memory_manager_Pool.get_PM_MemoryManager(&mmanager);
+    EpochGuard guard;
+    auto offset = append_record(
+        b.size, [&b](char *addr) { memcpy(addr, b.buffer, b.size); });
+    int done[MAX_BUFFER_PAIR_SIZE];
+    std::fill(done, done + b.count, DONE);
+    for (size_t i = 0, pos = 0; i < b.count; i++) {
+      auto n = GET_CLHT_INDEX(b.hkeys[i], TABLE_NUM);
+      if (b.olds[i] == INVALID) {
+        // inserted meanwhile, or earlier in the batch
+        if (!clhts[n]->clht_put(b.hkeys[i], offset)) {
+          discard_record(offset, b.lens[i]);
+          done[i] = EXIST;
+        }
+      } else if (!index_tombstone(b.hkeys[i], b.olds[i], offset, b.lens[i])) {
+        // the entry changed since the tombstone was buffered
+        auto k = Pair_t<KEY, VALUE>::key_view(b.buffer + pos);
+        if (!delete_tombstone(b.hkeys[i], k.data(), k.size(), nullptr, false))
+          done[i] = NOT_FOUND;
+      }
+      offset += b.lens[i];
+      pos += b.lens[i];
     }
-    if (ptr) WRITE_BUFFER_COUNTER++;
     // write back the result.
-    for (size_t i = 0; i < WRITE_BUFFER_COUNTER; i++) {
-      *INSERT_RESULT_POINTER[i] = DONE;
+    for (size_t i = 0; i < b.count; i++)
+      if (b.results[i]) *b.results[i] = done[i];
+    b.size = 0;
+    b.count = 0;
+    b.since.store(0, std::memory_order_relaxed);
+  }
+  /* The key hash of the record at a log offset, INVALID if it is gone. */
+  static size_t hkey_at(size_t offset) {
+    auto page = PPage_table[offset / PAGE_SIZE].load();
+    if (page == INVALID || page == 0) return INVALID;
+    auto k = Pair_t<KEY, VALUE>::key_view(
+        reinterpret_cast<char *>(page + offset % PAGE_SIZE));
+    // a stale entry restored from a snapshot may point into a reused PPage
+    if (k.data() + k.size() > reinterpret_cast<char *>(page + PAGE_SIZE))
+      return INVALID;
+    return hash_func(k.data(), k.size());
+  }
+  /* The record at a log offset, nullptr for INVALID. */
+  Pair_t<KEY, VALUE> *pair_at(size_t offset) {
+    if (offset == INVALID) return nullptr;
+    return reinterpret_cast<Pair_t<KEY, VALUE> *>(
+        PPage_table[offset / PAGE_SIZE].load() + offset % PAGE_SIZE);
+  }
+  /* Drop a record written for a swap that failed. */
+  void discard_record(size_t offset, size_t len) {
+    pair_at(offset)->set_op_persist(OP_t::UPDATE);
+    free_space.add(offset / PAGE_SIZE, len);
+  }
+  /**
+   * @brief Hash a chunk of keys, prefetch their head buckets, then probe
+   * them and prefetch the indexed records, so the misses overlap. order
+   * lists the keys grouped by sub-table, the order their entries are
+   * updated in.
+   */
+  void multi_probe(Pair_t<KEY, VALUE> **ps, size_t cnt, size_t *hkeys,
+                   size_t *olds, size_t *order) {
+    for (size_t i = 0; i < cnt; i++) {
+      hkeys[i] = hash_func(reinterpret_cast<void *>(ps[i]->key()),
+                           ps[i]->klen());
+      order[i] = i;
+    }
+    std::sort(order, order + cnt, [hkeys](size_t a, size_t b) {
+      return GET_CLHT_INDEX(hkeys[a], TABLE_NUM) <
+             GET_CLHT_INDEX(hkeys[b], TABLE_NUM);
+    });
+    for (size_t j = 0; j < cnt; j++) {
+      auto h = hkeys[order[j]];
+      clhts[GET_CLHT_INDEX(h, TABLE_NUM)]->clht_prefetch(h);
+    }
+    for (size_t j = 0; j < cnt; j++) {
+      auto i = order[j];
+      olds[i] = clhts[GET_CLHT_INDEX(hkeys[i], TABLE_NUM)]
+                    ->clht_get(hkeys[i])
+                    .first;
+      if (olds[i] != INVALID) _mm_prefetch(pair_at(olds[i]), _MM_HINT_T0);
     }
-    WRITE_BUFFER_SIZE = 0;
-    WRITE_BUFFER_COUNTER = 0;
-    WRITE_PASS_COUNT = 0;
-    READ_LOCK();
+  }
+  /* Whether the record at addr is an indexed tombstone. */
+  bool is_tombstone(char *addr) {
+    return TOMBSTONE_DELETE && addr &&
+           reinterpret_cast<Pair_t<KEY, VALUE> *>(addr)->get_op() ==
+               OP_t::DELETED;
+  }
+  /**
+   * @brief Delete a key by a tombstone in the log of the calling thread, in
+   * its write batch if batching. The tombstone takes the next version of the
+   * key and stays indexed, so recovery hides the older records of the key
+   * and a later insert continues from its version.
+   *
+   * @param batch buffer the tombstone with WRITE_BATCHING.
+   * @return false if the key does not exist.
+   */
+  bool delete_tombstone(size_t hkey, const void *k, size_t klen, int *r,
+                        bool batch = true) {
+    static_assert(TOMBSTONE_VLEN<VALUE> >= sizeof(uint32_t),
+                  "a tombstone stores a PPage id in the value");
+    auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+    while (true) {
+      auto old_offset = clhts[n]->clht_get(hkey).first;
+      if (old_offset == INVALID) return false;
+      auto old = reinterpret_cast<Pair_t<KEY, VALUE> *>(
+          PPage_table[old_offset / PAGE_SIZE].load() + old_offset % PAGE_SIZE);
+      if (old->get_op() == OP_t::DELETED) return false;
+      char target[TOMBSTONE_VLEN<VALUE>] = {};
+      uint32_t page = old_offset / PAGE_SIZE;
+      memcpy(target, &page, sizeof(page));
+      auto version = old->version + 1;
+      auto len = Pair_t<KEY, VALUE>::encoded_size(klen, sizeof(target));
+      auto fill = [&](char *addr) {
+        Pair_t<KEY, VALUE>::encode(addr, RECORD_HEADER(OP_t::DELETED, version),
+                                   k, klen, target, sizeof(target));
+      };
+      if (WRITE_BATCHING && batch && len <= MAX_WRITE_BUFFER_SIZE) {
+        batch_record(hkey, old_offset, len, r, fill);
+        return true;
+      }
+      if (index_tombstone(hkey, old_offset, append_record(len, fill), len)) {
+        if (r) *r = DONE;
+        return true;
+      }
+    }
+  }
+  /**
+   * @brief Point the entry of a key from old to the tombstone at offset. The
+   * deleted record and the tombstone are both freed. A tombstone that lost
+   * to a concurrent update or delete is discarded.
+   */
+  bool index_tombstone(size_t hkey, size_t old, size_t offset, size_t len) {
+    auto n = GET_CLHT_INDEX(hkey, TABLE_NUM);
+    auto old_page = old / PAGE_SIZE;
+    auto p = reinterpret_cast<Pair_t<KEY, VALUE> *>(
+        PPage_table[offset / PAGE_SIZE].load() + offset % PAGE_SIZE);
+    if (Unlikely(clhts[n]->clht_swap(hkey, old, offset) != 1)) {
+      p->set_op_persist(OP_t::UPDATE);
+      free_space.add(offset / PAGE_SIZE, len);
+      return false;
+    }
+    auto victim = reinterpret_cast<Pair_t<KEY, VALUE> *>(
+        PPage_table[old_page].load() + old % PAGE_SIZE);
+    reclaim_ppage(old_page, free_space.add(old_page, victim->size()));
+    free_space.add(offset / PAGE_SIZE, len);
+    return true;
   }
   void restore_to_table(Pair_t<KEY, VALUE> p, size_t offset) {
     auto hkey = hash_func(reinterpret_cast<void *>(p.key()), p.klen());
@@ -1476,8 +2820,10 @@ class Halo {
     }
   }
   CLHT *clhts[TABLE_NUM];
-  mutex reclaim_mtx;
-  std::set<size_t> ppages_reclaiming;
-  std::unordered_set<size_t> ppages_to_reclaiming;
+  LogCleaner cleaner;
+  Checkpointer checkpointer;
+  // the checkpointer thread and the callers of checkpoint()
+  std::mutex checkpoint_mtx;
+  BatchFlusher flusher;
 };
 }  // namespace HALO
@@ -1,6 +1,8 @@
 #pragma once
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <type_traits>
 namespace HALO {
 #define ROUND_UP(s, n) (((s) + (n)-1) & (~(n - 1)))
 enum OP_t { TRASH, INSERT, DELETED, UPDATE };
@@ -10,10 +12,38 @@ const size_t MAX_KEY_LEN = 512;
 using OP_VERSION = uint32_t;
 constexpr int OP_BITS = 2;
 constexpr int VERSION_BITS = sizeof(OP_VERSION) * 8 - OP_BITS;
+// update small fixed-size values in place with one atomic store.
+constexpr bool INPLACE_UPDATE = false;
+template <typename KEY, typename VALUE>
+constexpr bool INPLACE_PAIR =
+    INPLACE_UPDATE && std::is_trivially_copyable_v<KEY> &&
+    std::is_trivially_copyable_v<VALUE> && sizeof(KEY) % 8 == 0 &&
+    sizeof(VALUE) <= 8 && (sizeof(VALUE) & (sizeof(VALUE) - 1)) == 0;
 
 
 #pragma pack(1)
-template <typename KEY, typename VALUE>
+// the header of every record, the same layout as the Pair_t fields.
+struct RECORD_HEADER {
+  OP_VERSION op : OP_BITS;
+  OP_VERSION version : VERSION_BITS;
+  RECORD_HEADER(OP_t o, OP_VERSION v) : op(o), version(v) {}
+};
+
+/* Rewrite the header at addr with f, atomic with other header updates. */
+template <typename F>
+inline void update_header(char *addr, F &&f) {
+  auto w = reinterpret_cast<OP_VERSION *>(addr);
+  OP_VERSION old = __atomic_load_n(w, __ATOMIC_RELAXED), neu;
+  do {
+    RECORD_HEADER h(OP_t::INSERT, 0);
+    memcpy(&h, &old, sizeof(h));
+    f(h);
+    memcpy(&neu, &h, sizeof(h));
+  } while (!__atomic_compare_exchange_n(w, &old, neu, false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+template <typename KEY, typename VALUE, typename = void>
 class Pair_t
 {
 public:
@@ -23,6 +53,8 @@ public:
   VALUE _value;
   Pair_t()
   {
+    op = 0;
+    version = 0;
     _key = 0;
     _value = 0;
   };
@@ -39,9 +71,28 @@ public:
   KEY *key() { return &_key; }
   KEY str_key() { return _key; }
   VALUE value() { return _value; }
+  // views into a record stored at p
+  static std::string_view key_view(const char *p) {
+    return {p + sizeof(OP_VERSION), sizeof(KEY)};
+  }
+  static std::string_view value_view(const char *p) {
+    return {p + sizeof(OP_VERSION) + sizeof(KEY), sizeof(VALUE)};
+  }
+  // serialize a record from raw key and value bytes
+  static size_t encoded_size(size_t klen, size_t vlen) {
+    return sizeof(OP_VERSION) + sizeof(KEY) + sizeof(VALUE);
+  }
+  static void encode(char *addr, RECORD_HEADER h, const void *k, size_t klen,
+                     const void *v, size_t vlen) {
+    memcpy(addr, &h, sizeof(h));
+    memcpy(addr + sizeof(h), k, sizeof(KEY));
+    memcpy(addr + sizeof(h) + sizeof(KEY), v, sizeof(VALUE));
+  }
   size_t klen() { return sizeof(KEY); }
   Pair_t(KEY k, VALUE v)
   {
+    op = 0;
+    version = 0;
     _key = k;
     _value = v;
   }
@@ -74,10 +125,16 @@ public:
   void set_op(OP_t o) { op = static_cast<OP_VERSION>(o); }
   OP_t get_op() { return static_cast<OP_t>(op); }
 
-  void set_op_persist(OP_t o)
+  // set_op on a PM record, durable after the next pmem_drain
+  void set_op_flush(OP_t o)
   {
     op = static_cast<uint16_t>(o);
-    pmem_persist(reinterpret_cast<char *>(this), 8);
+    pmem_flush(reinterpret_cast<char *>(this), 8);
+  }
+  void set_op_persist(OP_t o)
+  {
+    set_op_flush(o);
+    pmem_drain();
   }
 
   // friend std::ostream &operator<<(std::ostream &out, Pair_t A);
@@ -88,6 +145,95 @@ public:
   }
 };
 
+// A record whose value is updated in place. The key and the value are 8 B
+// aligned when the record is, and records are 8 B multiples, so the value is
+// written with one failure-atomic store.
+template <typename KEY, typename VALUE>
+class Pair_t<KEY, VALUE, std::enable_if_t<INPLACE_PAIR<KEY, VALUE>>> {
+ public:
+  OP_VERSION op : OP_BITS;
+  OP_VERSION version : VERSION_BITS;
+  uint32_t _reserved;
+  KEY _key;
+  VALUE _value;
+  static constexpr size_t VALUE_OFFSET = 2 * sizeof(OP_VERSION) + sizeof(KEY);
+  Pair_t() {
+    op = 0;
+    version = 0;
+    _reserved = 0;
+    _key = 0;
+    _value = 0;
+  };
+  Pair_t(char *p) { load(p); }
+  void load(char *p) { memcpy(this, p, sizeof(*this)); }
+  KEY *key() { return &_key; }
+  KEY str_key() { return _key; }
+  VALUE value() { return _value; }
+  static std::string_view key_view(const char *p) {
+    return {p + 2 * sizeof(OP_VERSION), sizeof(KEY)};
+  }
+  static std::string_view value_view(const char *p) {
+    return {p + VALUE_OFFSET, sizeof(VALUE)};
+  }
+  static size_t encoded_size(size_t klen, size_t vlen) {
+    return ROUND_UP(sizeof(Pair_t), 8);
+  }
+  static void encode(char *addr, RECORD_HEADER h, const void *k, size_t klen,
+                     const void *v, size_t vlen) {
+    uint32_t reserved = 0;
+    memcpy(addr, &h, sizeof(h));
+    memcpy(addr + sizeof(h), &reserved, sizeof(reserved));
+    memcpy(addr + 2 * sizeof(OP_VERSION), k, sizeof(KEY));
+    memcpy(addr + VALUE_OFFSET, v, sizeof(VALUE));
+  }
+  size_t klen() { return sizeof(KEY); }
+  Pair_t(KEY k, VALUE v) {
+    op = 0;
+    version = 0;
+    _reserved = 0;
+    _key = k;
+    _value = v;
+  }
+  void set_key(KEY k) { _key = k; }
+  void store_persist(void *addr) {
+    store(addr);
+    pmem_persist(addr, sizeof(*this));
+  }
+  void store_persist_update(char *addr) { store_persist(addr); }
+  void store(void *addr) { memcpy(addr, this, sizeof(*this)); }
+  /* Replace the value of the record at addr, false if it is not aligned. */
+  static bool update_value(char *addr, VALUE v) {
+    auto dst = reinterpret_cast<VALUE *>(addr + VALUE_OFFSET);
+    if (reinterpret_cast<uintptr_t>(dst) % 8) return false;
+    __atomic_store(dst, &v, __ATOMIC_RELEASE);
+    // a hint for the cleaner, and the newer copy wins if a crash leaves two
+    update_header(addr, [](RECORD_HEADER &h) { h.version = h.version + 1; });
+    pmem_persist(addr, VALUE_OFFSET + sizeof(VALUE));
+    return true;
+  }
+  void set_empty() {
+    _key = 0;
+    _value = 0;
+  }
+  void set_version(OP_VERSION old_version) { version = old_version + 1; }
+  void set_op(OP_t o) { op = static_cast<OP_VERSION>(o); }
+  OP_t get_op() { return static_cast<OP_t>(op); }
+  // deletes mark a record outside the bucket lock that in place updates hold
+  void set_op_flush(OP_t o) {
+    auto addr = reinterpret_cast<char *>(this);
+    if (reinterpret_cast<uintptr_t>(addr) % sizeof(OP_VERSION))
+      op = static_cast<uint16_t>(o);
+    else
+      update_header(addr, [o](RECORD_HEADER &h) { h.op = o; });
+    pmem_flush(addr, 8);
+  }
+  void set_op_persist(OP_t o) {
+    set_op_flush(o);
+    pmem_drain();
+  }
+  size_t size() { return ROUND_UP(sizeof(Pair_t), 8); }
+};
+
 template <typename KEY>
 class Pair_t<KEY, std::string> {
  public:
@@ -129,8 +275,31 @@ class Pair_t<KEY, std::string> {
   KEY *key() { return &_key; }
   KEY str_key() { return _key; }
   std::string str_value() { return svalue; }
+  std::string value() { return svalue; }
+  // views into a record stored at p
+  static std::string_view key_view(const char *p) {
+    return {p + sizeof(OP_VERSION), sizeof(KEY)};
+  }
+  static std::string_view value_view(const char *p) {
+    auto pt = reinterpret_cast<const Pair_t *>(p);
+    return {p + sizeof(OP_VERSION) + sizeof(KEY) + sizeof(uint32_t),
+            pt->_vlen};
+  }
+  // serialize a record from raw key and value bytes
+  static size_t encoded_size(size_t klen, size_t vlen) {
+    return sizeof(OP_VERSION) + sizeof(KEY) + sizeof(uint32_t) + vlen;
+  }
+  static void encode(char *addr, RECORD_HEADER h, const void *k, size_t klen,
+                     const void *v, size_t vlen) {
+    uint32_t l = vlen;
+    memcpy(addr, &h, sizeof(h));
+    memcpy(addr + sizeof(h), k, sizeof(KEY));
+    memcpy(addr + sizeof(h) + sizeof(KEY), &l, sizeof(l));
+    memcpy(addr + sizeof(h) + sizeof(KEY) + sizeof(l), v, vlen);
+  }
 
   Pair_t(KEY k, char *v_ptr, size_t vlen) : _vlen(vlen), version(0) {
+    op = 0;
     _key = k;
     svalue.assign(v_ptr, _vlen);
   }
@@ -160,9 +329,13 @@ class Pair_t<KEY, std::string> {
   void set_version(OP_VERSION old_version) { version = old_version + 1; }
   void set_op(OP_t o) { op = static_cast<OP_VERSION>(o); }
   OP_t get_op() { return static_cast<OP_t>(op); }
-  void set_op_persist(OP_t o) {
+  void set_op_flush(OP_t o) {
     op = static_cast<uint16_t>(o);
-    pmem_persist(reinterpret_cast<char *>(this), 8);
+    pmem_flush(reinterpret_cast<char *>(this), 8);
+  }
+  void set_op_persist(OP_t o) {
+    set_op_flush(o);
+    pmem_drain();
   }
   size_t size() {
     auto total_length =
@@ -213,9 +386,35 @@ class Pair_t<std::string, std::string> {
   char *key() { return &skey[0]; }
   std::string str_key() { return skey; }
   std::string value() { return svalue; }
+  // views into a record stored at p
+  static std::string_view key_view(const char *p) {
+    auto pt = reinterpret_cast<const Pair_t *>(p);
+    return {p + sizeof(OP_VERSION) + sizeof(uint32_t) + sizeof(uint32_t),
+            pt->_klen};
+  }
+  static std::string_view value_view(const char *p) {
+    auto pt = reinterpret_cast<const Pair_t *>(p);
+    return {p + sizeof(OP_VERSION) + sizeof(uint32_t) + sizeof(uint32_t) +
+                pt->_klen,
+            pt->_vlen};
+  }
+  // serialize a record from raw key and value bytes
+  static size_t encoded_size(size_t klen, size_t vlen) {
+    return sizeof(OP_VERSION) + sizeof(uint32_t) + sizeof(uint32_t) + klen +
+           vlen;
+  }
+  static void encode(char *addr, RECORD_HEADER h, const void *k, size_t klen,
+                     const void *v, size_t vlen) {
+    uint32_t l[2] = {static_cast<uint32_t>(klen), static_cast<uint32_t>(vlen)};
+    memcpy(addr, &h, sizeof(h));
+    memcpy(addr + sizeof(h), l, sizeof(l));
+    memcpy(addr + sizeof(h) + sizeof(l), k, klen);
+    memcpy(addr + sizeof(h) + sizeof(l) + klen, v, vlen);
+  }
 
   Pair_t(char *k_ptr, size_t klen, char *v_ptr, size_t vlen)
       : _klen(klen), _vlen(vlen), version(0) {
+    op = 0;
     skey.assign(k_ptr, _klen);
     svalue.assign(v_ptr, _vlen);
   }
@@ -255,9 +454,13 @@ class Pair_t<std::string, std::string> {
   void set_version(OP_VERSION old_version) { version = old_version + 1; }
   void set_op(OP_t o) { op = static_cast<OP_VERSION>(o); }
   OP_t get_op() { return static_cast<OP_t>(op); }
-  void set_op_persist(OP_t o) {
+  void set_op_flush(OP_t o) {
     op = static_cast<uint16_t>(o);
-    pmem_persist(reinterpret_cast<char *>(this), 8);
+    pmem_flush(reinterpret_cast<char *>(this), 8);
+  }
+  void set_op_persist(OP_t o) {
+    set_op_flush(o);
+    pmem_drain();
   }
 
   size_t size() {
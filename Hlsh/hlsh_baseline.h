@@ -22,6 +22,27 @@ class HLSH {
   inline bool Get(Pair_t<KEY, VALUE> *p);
   inline bool UpdateForReclaim(Pair_t<KEY, VALUE> *p,
                                PmOffset old_value, PmOffset new_value);
+  template <typename F>
+  inline bool ReadModifyWrite(Pair_t<KEY, VALUE>* p, F&& f,
+                              size_t thread_id = 0);
+  /* insert p, or update it if the key exists */
+  inline bool Upsert(Pair_t<KEY, VALUE>* p, size_t thread_id = 0) {
+    return ReadModifyWrite(
+        p, [](Pair_t<KEY, VALUE>*, Pair_t<KEY, VALUE>*) { return true; },
+        thread_id);
+  }
+  /* update the key to desired if its value is expected's */
+  inline bool CompareAndSwap(Pair_t<KEY, VALUE>* expected,
+                             Pair_t<KEY, VALUE>* desired,
+                             size_t thread_id = 0) {
+    return ReadModifyWrite(
+        desired,
+        [expected](Pair_t<KEY, VALUE>* current, Pair_t<KEY, VALUE>*) {
+          return current && current->cmp_value(expected);
+        },
+        thread_id);
+  }
+  inline void Expand(Segment<KEY, VALUE>* seg, Directory<KEY, VALUE>* copy_dir);
   inline void DirectoryDouble();
   inline void DirectoryUpdate(Directory<KEY, VALUE> *d,
                               Segment<KEY, VALUE> *new_seg);
@@ -437,57 +458,96 @@ class HLSH {
         if (rSegmentChanged == r) { goto RETRY; }
         // s3.4: segment need to split due to it is full
         if (rNoEmptySlot == r) {
-            auto old_local_depth = seg->local_depth;
-            if (old_local_depth < copy_dir->global_depth) {
-                //s3.4.2: split segment without directory double
-                seg->lock.GetLock();
-                if (old_local_depth != seg->local_depth) {
-                    // s3.4.2.1: other thread has split this segment
-                    seg->lock.ReleaseLock();
-                }
-                else {
-                    // s: persist segment to pm
-                    if (seg->ph)
-                    {
-                        seg->ph->PersistSegment(seg);
-                    }
-                    // s: get the newest dir
-                    auto d = LOAD(&dir);
-                    if (d != copy_dir) {
-                        copy_dir = d;
-                    }
-                    // s: get buckets lock
-                    seg->GetBucketsLock();
-                    // s: split segment
-                    auto new_seg = seg->Split();
-                    // s: update direcotry entries
-                    DirectoryUpdate(copy_dir, new_seg);
-                    // s: release lock for new seg
-                    new_seg->ReleaseBucketsLock();
-                    new_seg->lock.ReleaseLock();
-                    // s: release lock for split seg
-                    seg->ReleaseBucketsLock();
-                    seg->lock.ReleaseLock();
-                }
+            Expand(seg, copy_dir);
+            // s3.4.3 retry insert
+            goto RETRY;
+        }
+
+        return 0;
+    }
+
+    /* split a full segment, or double the directory if one entry points to it */
+    template <class KEY, class VALUE>
+    void HLSH<KEY, VALUE>::Expand(Segment<KEY, VALUE> *seg,
+                                  Directory<KEY, VALUE> *copy_dir) {
+        auto old_local_depth = seg->local_depth;
+        if (old_local_depth < copy_dir->global_depth) {
+            //s3.4.2: split segment without directory double
+            seg->lock.GetLock();
+            if (old_local_depth != seg->local_depth) {
+                // s3.4.2.1: other thread has split this segment
+                seg->lock.ReleaseLock();
             }
             else {
-                // s3.4.3: double directory due to segment is only pointed by one entry
-                dir_lock.GetLock();
-                auto d = LOAD(&dir);
-                if (copy_dir->version != d->version)
+                // s: persist segment to pm
+                if (seg->ph)
                 {
-                    // s3.4.3.1: new directory has been allocated
-                    dir_lock.ReleaseLock();
-                    goto RETRY;
+                    seg->ph->PersistSegment(seg);
+                }
+                // s: get the newest dir
+                auto d = LOAD(&dir);
+                if (d != copy_dir) {
+                    copy_dir = d;
                 }
-                DirectoryDouble();
+                // s: get buckets lock
+                seg->GetBucketsLock();
+                // s: split segment
+                auto new_seg = seg->Split();
+                // s: update direcotry entries
+                DirectoryUpdate(copy_dir, new_seg);
+                // s: release lock for new seg
+                new_seg->ReleaseBucketsLock();
+                new_seg->lock.ReleaseLock();
+                // s: release lock for split seg
+                seg->ReleaseBucketsLock();
+                seg->lock.ReleaseLock();
+            }
+        }
+        else {
+            // s3.4.3: double directory due to segment is only pointed by one entry
+            dir_lock.GetLock();
+            auto d = LOAD(&dir);
+            if (copy_dir->version != d->version)
+            {
+                // s3.4.3.1: new directory has been allocated
+                dir_lock.ReleaseLock();
+                return;
             }
+            DirectoryDouble();
+        }
+    }
 
-            // s3.4.3 retry insert
+    /* read-modify-write: f(current, p) sets the value of p from the current
+     * pair, nullptr if the key does not exist, or returns false to keep it */
+    template <class KEY, class VALUE>
+    template <typename F>
+    bool HLSH<KEY, VALUE>::ReadModifyWrite(Pair_t<KEY, VALUE> *p, F &&f,
+                                           size_t thread_id) {
+#ifndef DRAM_INDEX
+        tl_value.InitValue();
+#endif
+        // s1: caculate hash value for key-value pair
+        uint64_t key_hash = h(p->key(), p->klen());
+    RETRY:
+        // s2: get segment pointer
+        Directory<KEY,VALUE>* copy_dir = nullptr;
+        auto seg = GetSegmentWithDirUpdate(key_hash, &copy_dir);
+        // s3: read, modify and write under the bucket lock
+        auto r = seg->ReadModifyWrite(p, key_hash, pm, thread_id, this, f);
+        if (rSegmentChanged == r) { goto RETRY; }
+        if (rNoEmptySlot == r) {
+#ifndef DRAM_INDEX
+            // s: f runs again after the split, drop the pair it wrote
+            if (tl_value != PO_NULL)
+            {
+                pm->Delete(tl_value);
+                tl_value.InitValue();
+            }
+#endif
+            Expand(seg, copy_dir);
             goto RETRY;
         }
-
-        return 0;
+        return rFailure != r;
     }
 
     /* update: inplace for fixed-length key_value; out-of-place for varied-length kv */
@@ -415,6 +415,16 @@ namespace HLSH_hashing
       return true;
     }
 
+    /* the offset of the pair at pos returned by FindDuplicate */
+    inline PmOffset GetValue(SpareBucket<KEY, VALUE> *sb, int pos)
+    {
+      if (pos < kBucketNormalSlotNum)
+        return slot[pos].value;
+      else if (pos < 12)
+        return sb->_[slot[pos - kBucketNormalSlotNum].value.spos].value;
+      return sb->_[spos[pos - 12]].value;
+    }
+
     inline int Get(Pair_t<KEY, VALUE> *p, uint64_t key_hash,
                    uint8_t finger, SpareBucket<KEY, VALUE> *sb)
     {
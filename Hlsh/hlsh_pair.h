@@ -80,6 +80,11 @@ namespace HLSH_hashing
       return false;
     }
 
+    inline bool cmp_value(Pair_t<KEY, VALUE> *other)
+    {
+      return _value == other->_value;
+    }
+
     inline KEY *key() { return &_key; }
     inline size_t klen() { return sizeof(KEY); }
 
@@ -189,6 +194,11 @@ namespace HLSH_hashing
       return false;
     }
 
+    inline bool cmp_value(Pair_t<KEY, std::string> *other)
+    {
+      return _vlen == other->_vlen && !memcmp(svalue, other->svalue, _vlen);
+    }
+
     size_t klen() { return sizeof(KEY); }
     KEY *key() { return &_key; }
 
@@ -304,6 +314,12 @@ namespace HLSH_hashing
       return false;
     }
 
+    inline bool cmp_value(Pair_t<std::string, std::string> *other)
+    {
+      return _vlen == other->_vlen &&
+             !memcmp(svalue + _klen, other->svalue + other->_klen, _vlen);
+    }
+
     size_t klen() { return _klen; }
     char *key() { return svalue; }
 
@@ -95,6 +95,10 @@ namespace HLSH_hashing
     inline int UpdateForReclaim(Pair_t<KEY, VALUE> *p, size_t key_hash,
                                 PmOffset old_value, PmOffset new_value,
                                 PmManage<KEY, VALUE> *pm, HLSH<KEY, VALUE> *index);
+    template <typename F>
+    inline int ReadModifyWrite(Pair_t<KEY, VALUE> *p, uint64_t key_hash,
+                               PmManage<KEY, VALUE> *pm, size_t thread_id,
+                               HLSH<KEY, VALUE> *index, F &&f);
     inline int HelpSplit();
     inline int SplitBucket(Bucket<KEY, VALUE> *, Segment<KEY, VALUE> *, size_t, size_t);
     inline void GetBucketsLock();
@@ -308,6 +312,60 @@ namespace HLSH_hashing
     return r;
   }
 
+  /* find, read and write a key under one bucket lock, f(current, p) sets p */
+  template <class KEY, class VALUE>
+  template <typename F>
+  int Segment<KEY, VALUE>::ReadModifyWrite(Pair_t<KEY, VALUE> *p,
+                                           uint64_t key_hash,
+                                           PmManage<KEY, VALUE> *pm,
+                                           size_t thread_id,
+                                           HLSH<KEY, VALUE> *index, F &&f)
+  {
+    // s0: get finger for key and bucket index
+    auto finger = KEY_FINGER(key_hash); // the last 8 bits
+    auto y = BUCKET_INDEX(key_hash);
+    // s1: get bucket lock
+    auto t = bucket + y;
+    t->lock.GetLock();
+    // s: judge whether segment has been split
+    if (this != index->GetSegment(key_hash))
+    {
+      t->lock.ReleaseLock();
+      return rSegmentChanged;
+    }
+    // s2: read the current pair
+    auto pos = t->FindDuplicate(p, key_hash, finger, &sbucket);
+    Pair_t<KEY, VALUE> *current = nullptr;
+#ifndef DRAM_INDEX
+    if (pos != rFailure)
+      current = GETP_PAIR(t->GetValue(&sbucket, pos).GetValue());
+#endif
+    if (!f(current, p))
+    {
+      t->lock.ReleaseLock();
+      return rFailure;
+    }
+    // s3: write the new pair and swap its offset in
+    int r = rSuccess;
+    if (pos != rFailure)
+    {
+      t->Update(p, key_hash, pm, thread_id, &sbucket, pos);
+    }
+    else
+    {
+#ifndef DRAM_INDEX
+      if (tl_value == PO_NULL)
+      {
+        tl_value = pm->Insert(p, thread_id);
+      }
+#endif
+      r = t->Insert(key_hash, tl_value, finger, &sbucket);
+    }
+    // s: release lock
+    t->lock.ReleaseLock();
+    return r;
+  }
+
   template <class KEY, class VALUE>
   int Segment<KEY, VALUE>::UpdateForReclaim(
       Pair_t<KEY, VALUE> *p, size_t key_hash,
@@ -139,26 +139,16 @@ class hash_api {
   bool insert(size_t key, size_t value_len, char *value, int tid = 0,
               int *r = nullptr) {
 #ifdef NONVAR
-    Pair_t<size_t, size_t> p(key, *reinterpret_cast<size_t *>(value));
-#elif VARVALUE
-    Pair_t<size_t, std::string> p(key, value, value_len);
-#else
-    Pair_t<std::string, std::string> p(reinterpret_cast<char *>(&key), 8, value,
-                                       value_len);
+    value_len = sizeof(size_t);
 #endif
-    return t->Insert(p, r);
+    return t->Insert(&key, sizeof(key), value, value_len, r);
   }
   bool update(size_t key, size_t value_len, char *value, int tid = 0,
               int *r = nullptr) {
 #ifdef NONVAR
-    Pair_t<size_t, size_t> p(key, *reinterpret_cast<size_t *>(value));
-#elif VARVALUE
-    Pair_t<size_t, std::string> p(key, value, value_len);
-#else
-    Pair_t<std::string, std::string> p(reinterpret_cast<char *>(&key), 8, value,
-                                       value_len);
+    value_len = sizeof(size_t);
 #endif
-    return t->Update(p, r);
+    return t->Update(&key, sizeof(key), value, value_len, r);
   }
 
   bool erase(size_t key, int tid = 0) {